@@ -18,17 +18,24 @@
  *
  *	You may not have strchr. Include -Dstrchr=index in CFLAGS.
  *
- *	All directories have short fields which are byte swapped and long
- *	fields which are byte reversed on reading the directory, and the same
- *	operation on writing. This may need to be changed depending on the byte
- *	order on your machine. It is done by the routine fixdir(). To check,
- *	just compile mar, do a 't' on a valid MS-DOS volume and check the file
- *	sizes. If the sizes are wrong, try using -DNOSWAB to cc. Otherwise
- *	it's over to you.
+ *	Binary extraction asks the kernel to copy runs of clusters straight
+ *	from the device with copy_file_range() or sendfile(). If your system
+ *	has neither, include -DNOKCOPY in CFLAGS.
  *
- *	Check also the order in which your compiler allocates bit-fields.
- *	If it is different from ours (MSB first) then dates and times will
- *	be wrong. Edit the 'struct dir' definition to reverse the declarations.
+ *	Directory entries are kept just as they are on the disk, and their
+ *	numeric fields are put together a byte at a time when they are used
+ *	(see dstart() etc), so byte order and bit-field order don't matter.
+ *	On a little-endian machine that doesn't mind unaligned access,
+ *	-DNOSWAB makes those plain loads and stores.
+ *
+ *	The 'l' server uses UNIX domain sockets and poll(). Without them,
+ *	include -DNOSERVER in CFLAGS.
+ *
+ *	'Z' uses fallocate() and the Linux BLKZEROOUT ioctl. Elsewhere,
+ *	include -DNOZERO in CFLAGS and zeros are written instead.
+ *
+ *	'q' uses POSIX threads; link with -lpthread. Without them, include
+ *	-DNOTHREAD in CFLAGS and 'q' does nothing.
  *
  *
  *	Usage:
@@ -42,6 +49,10 @@
  *	If device/file doesn't exist, a query will determine whether it is
  *	to be created.
  *
+ *	If device/file starts with '@', the rest names a manifest file
+ *	(or '-' for standard input) listing images one per line, and the
+ *	command is done to each of them (see 'w').
+ *
  *	Commands:
  *	c	format disk (clobber all existing files)
  *		implies 'r' if files are specified.
@@ -50,15 +61,64 @@
  *		If a filename given is a UNIX directory, an empty MSDOS
  *		directory will be created.
  *	t	list files on disk. If no files are specified, list whole disk.
+ *		Names given may contain the wildcards '*' and '?'.
  *		Without 'v', gives pathnames only.
  *		With 'v', gives attributes (hidden, system, directory, readonly)
  *			time, date, size and filename.
  *	x	extract files from disk. Directories are extracted recursively.
+ *		Files and directories get the times they have on the disk.
+ *	u	update disk from UNIX files and directories, recursively.
+ *		Only files whose size or time differ are rewritten.
  *	d	delete files from disk. If no files are specified, this is 'c'.
+ *	z	defragment. Make every file's clusters contiguous, with each
+ *		directory placed just before the files in it.
+ *	k	check the disk. Report cross-linked and lost clusters, files
+ *		whose size doesn't match their chain, and FAT copies that
+ *		differ. Exit status is 1 if anything is wrong.
+ *	b	batch. Read commands from the file given (or standard input),
+ *		one per line as "key file ...", and do them all to the device
+ *		opened once. The FAT and root directory are written at the end.
+ *		"stat file ...", "flush" and "quit" may also be used.
+ *	D	delta. Write to the second file named (or '-') the changes
+ *		that would make the device the same as the first.
+ *	A	apply a delta made by 'D' from the file named (or '-').
+ *	C	copy files and directories (or everything) from the device to
+ *		the image named first, with their attributes and times.
+ *	l	listen. Serve script lines from clients on the UNIX domain
+ *		socket named after the device, keeping the disk open. Each
+ *		reply ends with a line "." (or "?" if something went wrong).
+ *		Changes are written after 5 seconds idle or 30 seconds
+ *		busy, on "flush", and when the server gets "quit", SIGINT
+ *		or SIGTERM.
  *
  *	Flags:
  *	v	verbose. For rxc, says which files; for t, gives size, date etc.
  *	a	ascii. Convert line end characters from/to \r\n <--> \n.
+ *	s	sparse. On x, clusters of zeros are not written but left as
+ *		holes in the UNIX file.
+ *	n	dry run. For z, just say how much would be moved.
+ *	h	for u, compare the contents of files that look unchanged.
+ *		For r and u, don't rewrite clusters of a file being replaced
+ *		that already hold the same data.
+ *	P	prune. For u, delete what's no longer in a UNIX directory.
+ *	R	recursive. For d, delete directories and everything in them.
+ *	q	for r, read the files ahead in another thread while what's
+ *		been read already is written.
+ *	T	for t, list path, attributes, size, time and first cluster
+ *		as tab separated fields, one file per line.
+ *	N	as T, but every field is ended by a NUL instead.
+ *	J	as T, but as a JSON object per line.
+ *	w<n>	with an '@' list of images, do up to n of them at once.
+ *		The default is one at a time.
+ *	L<n>	keep only n sectors of the FAT in memory, reading them as
+ *		they are wanted and writing back the least recently used.
+ *	B<n>	cache the last n clusters read or written in memory,
+ *		writing changed ones back in runs.
+ *	K<n>	read and write UNIX files n Kb at a time (default 1024).
+ *	Z	with c, make the data area read as zeros, by punching it out of
+ *		an image file or having a block device zero (or discard) it.
+ *	O	overlay. The first file named is an overlay file, made if
+ *		need be, that gets all changes; the device is only read.
  *
  *	Disk types (as in "dtypes" table below)
  *	mar knows how to access all HP150 disk types:
@@ -81,9 +141,13 @@
  *		O = Number of copies of the FAT.
  *		P = Number of CLUSTERS after boot area, FATs and root dir.
  *
+ *	If no type is given and the boot record holds a sane BIOS
+ *	parameter block, the geometry is taken from that instead.
+ *	New disks get a parameter block filled in to match their type.
+ *
  *	Not yet implemented:
  *		Non recursive directory list
- *		Recursive replace. ('R')
+ *		Recursive replace.
  *		Command-line specification of different disk formats.
  *
  *	Implemented but not tested:
@@ -112,32 +176,79 @@
 #include	<errno.h>
 #include	<string.h>
 #include	<stdlib.h>
+#include	<dirent.h>
+#include	<fcntl.h>
+#define	truncate	unix_truncate	/* mar has its own */
+#include	<unistd.h>
+#undef	truncate
+#include	<sys/wait.h>
+#ifndef	NOKCOPY
+#include	<sys/sendfile.h>
+ssize_t	copy_file_range();	/* Only in <unistd.h> with _GNU_SOURCE */
+#endif
+#ifndef	NOZERO
+#include	<sys/ioctl.h>
+#include	<linux/fs.h>
+#include	<linux/falloc.h>
+int	fallocate();
+#endif
+#ifndef	NOTHREAD
+#include	<pthread.h>
+#endif
+#ifndef	NOSERVER
+#include	<sys/socket.h>
+#include	<sys/un.h>
+#include	<poll.h>
+#include	<signal.h>
+#endif
+
+typedef	unsigned char	uchar;
 
+/*
+ *	A directory entry, as it is on the disk.
+ *	Numbers are little-endian; use the access macros below.
+ */
 typedef struct
 {
 	char	name[11];
 	char	attr;
 	char	fill[10];
-
-#define	SWABFROM	fill[10]		/* swap bytes from here */
-	short	hour:5;		/* 0-23 */
-	short	minute:6;	/* 0-59 */
-	short	second:5;	/* Seconds/2 */
-
-	short	year:7;		/* Year - 1980 */
-	short	month:4;	/* 1-12 */
-	short	day:5;		/* 1-31 */
-
-	short	start;		/* Starting cluster */
-	union {
-		long	lsize;
-		short	ssize[2];	/* for swapping */
-	}	s;
-#define	size	s.lsize
-#define	SWABTO		size			/* to here */
+	uchar	time[2];	/* hour:5 minute:6 seconds/2:5 */
+	uchar	date[2];	/* year-1980:7 month:4 day:5 */
+	uchar	start[2];	/* Starting cluster */
+	uchar	size[4];	/* File size */
 }
 	dir;
 
+/*
+ *	Little-endian numbers
+ */
+#ifdef	NOSWAB
+#define	two(p)		(*(unsigned short *)(p))
+#define	four(p)		((long)*(unsigned int *)(p))
+#define	settwo(p,v)	(*(unsigned short *)(p) = (v))
+#define	setfour(p,v)	(*(unsigned int *)(p) = (v))
+#else
+#define	two(p)		((p)[0] | (p)[1]<<8)
+#define	four(p)		(two(p) | (long)two((p)+2)<<16)
+#define	settwo(p,v)	setle(p,(long)(v),2)	/* v once only */
+#define	setfour(p,v)	setle(p,(long)(v),4)
+#endif
+
+/*
+ *	Directory entry fields
+ */
+#define	dhour(dp)	(two((dp)->time)>>11)
+#define	dminute(dp)	(two((dp)->time)>>5 & 077)
+#define	dsecond(dp)	(two((dp)->time) & 037)		/* Seconds/2 */
+#define	dyear(dp)	(two((dp)->date)>>9)		/* Year - 1980 */
+#define	dmonth(dp)	(two((dp)->date)>>5 & 017)
+#define	dday(dp)	(two((dp)->date) & 037)
+#define	dstart(dp)	two((dp)->start)
+#define	dsize(dp)	four((dp)->size)
+#define	setstart(dp,v)	settwo((dp)->start,v)
+#define	setsize(dp,v)	setfour((dp)->size,v)
+
 /*
  *	Bits in attr
  */
@@ -162,6 +273,7 @@ typedef struct
 #define	DPCLUS	(CLUSIZE/sizeof(dir)) /* Directory entries per cluster */
 
 int	dtype;
+int	dgiven = 0;		/* Disk type was named on the command line */
 struct	disk
 {
 	char	type;
@@ -212,15 +324,43 @@ struct	disk
 };
 
 extern	int	errno;
-int	clobber = 0, verbose = 0, binary = 1;
+int	clobber = 0, verbose = 0, binary = 1, sparse = 0, dryrun = 0;
+int	cmpdata = 0, prune = 0, recurse = 0;
+int	zerodata = 0;		/* Format clears the data area */
+long	hostbuf = 1024L*1024;	/* Biggest UNIX file buffer, from 'K' */
+int	pipeline = 0;		/* Replace with a reader thread */
+int	qon = 0;		/* replace() reads from the reader's ring */
+long	qasize;			/* Ascii size of the file replace() has */
+#define	QFD	(-2)		/* replace()'s fd for the ring */
+char	lformat = 0;		/* Machine readable listing: T, N or J */
+int	nworkers = 1;		/* Images done at once from a manifest */
+int	nocreate = 0;		/* Don't offer to create a missing device */
+int	overlay = 0;		/* Write to an overlay, not the device */
+int	ovfd = -1;		/* Overlay file, if any */
+char	*ovname;
+uchar	*ovmap;			/* Blocks present in the overlay */
+long	ovnblk;			/* Blocks in the map */
+int	ovmod;			/* Map needs writing */
+char	*tag;			/* Image name for listings from a manifest */
 int	nfiles;
+int	nerrors = 0;		/* Problems found by 'k', and failures */
 char	cmd = 0;
 char	*device;
 char	**files;
 void	opendevice(), erexit(), forall(), show(), replace(), makedir(),
-	makeent(), extract(), extrall(), do_extract(), delete(), listdir(),
-	putdir(), truncate(), putfat(), dos_format(), dos_end(), myswab(),
-	readboot(), showboot(), writeboot(), hex_dump();
+	makeent(), extract(), extrall(), do_extract(), delete(),
+	listdir(), putdir(), truncate(), putfat(), dos_format(),
+	dos_end(), defrag(), dfwalk(), dfplace(), check(), ckwalk(),
+	ckfats(), update(), updir(), deltree(), delwalk(), delchain(),
+	delflush(), dosname(), settime(), pcompile(), psort(), ppop(),
+	pinit(), upwalk(), lentry(), oput(), oputs(), onum(), oflush(),
+	ojson(), drec(), fcinit(), fatwrite(), fatfresh(), fill3(),
+	zero(), qforall(), qfull(), qempty(), qdone(), bcinit(),
+	bcflush(), bcforget(), vput(), vget(), imcopy(), cptree(),
+	mkdelta(), apdelta(), ovopen(), ovflush(), ovfill(), multi(),
+	image(), runcmd(), script(), pfree(), saveflags(), restflags(),
+	statf(), dosflush(), serve(), readboot(), showboot(), writeboot(),
+	bpbgeom(), hex_dump(), setle();
 
 int	disk;
 int	getdir_num;
@@ -232,12 +372,105 @@ int	fat_mod;		/* File allocation table has been modified */
 dir	*dirblk;
 char	*fat;
 
+/*
+ *	Paged FAT.
+ *	With 'L<n>', only n sectors of the FAT are kept in memory (fat is
+ *	not used). Each is read when first wanted, and written back to every
+ *	copy of the FAT when the least recently used one has to make room,
+ *	or by dos_end().
+ */
+struct	fatpage
+{
+	int	sec;		/* Sector of the FAT held, or -1 */
+	int	dirty;
+	long	used;		/* When last wanted */
+	char	*data;
+};
+struct	fatcache
+{
+	int	npages;
+	struct	fatpage	*pages;
+	int	*slot;		/* Page holding each FAT sector, or -1 */
+	long	clock;
+}	*fc;
+int	fatpages = 0;		/* Pages to use, from 'L' */
+
+/*
+ *	Cluster cache.
+ *	With 'B<n>', readclus() and writeclus() keep the last n clusters
+ *	used in memory. Reads of those are served from there, and writes
+ *	only go into the cache. The clusters changed are written back, runs
+ *	of neighbours at once, when one of them is the least recently used
+ *	and has to make room, and by dos_end(). Anything that gets at the
+ *	data area other than through readclus() and writeclus() must call
+ *	bcflush() first.
+ */
+struct	bcblk
+{
+	int	clus;		/* Cluster held, or -1 */
+	int	dirty;
+	long	used;		/* When last wanted */
+	char	*data;
+};
+struct	bcache
+{
+	int	nblks;
+	struct	bcblk	*blks;
+	int	*slot;		/* Block holding each cluster, or -1 */
+	int	ndirty;
+	long	clock;
+	char	*run;		/* For writing runs of clusters */
+	long	hits, misses, written, runs;
+}	*bc;
+int	bcblocks = 0;		/* Clusters to cache, from 'B' */
+#define	BCRUN	16		/* Most clusters written at once */
+
+/*
+ *	The pathname of where a tree walk has got to.
+ *	Components are pushed and popped in place (see ppush()), so each
+ *	costs only its own length, and the buffer grows to fit any path.
+ *	It may move when it grows, so walkers always use pathbuf
+ *	rather than keeping a pointer into it.
+ */
+char	*pathbuf;
+int	pathlen, pathmax;
+
+/*
+ *	The file arguments, compiled into a tree of path components
+ *	so that a directory entry can be matched against all of them
+ *	at once. Plain names are kept in MSDOS form, sorted, so that
+ *	they can be found with a binary search on the raw entry name.
+ */
+struct	pnode
+{
+	char	name[11];	/* MSDOS name, if no wildcards */
+	char	*pat;		/* The pattern, if there are */
+	char	leaf;		/* A file argument ends here */
+	struct	pnode	**kids;	/* Plain children, sorted */
+	int	nkids;
+	struct	pnode	*wild;	/* Children with wildcards */
+	struct	pnode	*next;	/* Next of those */
+}	*ptree;
+int	npnodes;
+
 dir	*getdisk();
 dir	*getdir();
-dir	*fixdir();
-char	*fixname();
+dir	*lookup();
+int	strncmp11();
+int	pnodecmp();
+time_t	dostime();
+unsigned long	fnv(), imghash();
+long	zread();
+long	hostsize(), hostread(), asize(), qread();
+dir	*findvol();
+char	*fatp();
+struct	qbuf	*qfree(), *qnext();
+void	*qreader();
+struct	bcblk	*bcget();
+char	*fixname(), *xdir();
 long	diskfree();
 char	*Malloc();
+struct	pnode	*pnew();
 char	*strchr();
 struct	tm	*localtime();
 
@@ -250,6 +483,24 @@ char	*a;
 	exit(1);
 }
 
+#ifndef	NOSWAB
+/*
+ *	Store v little-endian in n bytes at p
+ */
+void
+setle(p,v,n)
+register uchar	*p;
+register long	v;
+register n;
+{
+	while (--n >= 0)
+	{
+		*p++ = v;
+		v >>= 8;
+	}
+}
+#endif
+
 main(argc,argv)
 char **argv;
 {
@@ -257,7 +508,7 @@ char **argv;
 	char		*p = argv[1];
 
 	if (argc < 3)
-		erexit("Usage: %s [tcrxd][v] device [file ...]\n",argv[0]);
+		erexit("Usage: %s [tcrxdzkublDAC][v] device [file ...]\n",argv[0]);
 	device = argv[2];
 	files = argv+3;
 	nfiles = argc-3;
@@ -267,22 +518,61 @@ char **argv;
 	case 'x':	/* Extract */
 	case 'r':	/* Replace */
 	case 'd':	/* Delete */
+	case 'z':	/* Defragment */
+	case 'k':	/* Check */
+	case 'u':	/* Update */
+	case 'b':	/* Batch script */
+	case 'l':	/* Listen on a socket */
+	case 'D':	/* Make a delta */
+	case 'A':	/* Apply a delta */
+	case 'C':	/* Copy to another image */
 		if (cmd)
-			erexit("Only one of [tcrxd] may be specified\n", 0);
+			erexit("Only one of [tcrxdzkublDAC] may be specified\n", 0);
 		cmd = p[-1];
 		break;
-	case 'v':
-		verbose++;
-		break;
-	case 'a':
-		binary = 0;
-		break;
 	case 'c':
 		clobber++;
 		break;
+	case 'Z':
+		zerodata++;
+		break;
+	case 'O':
+		overlay++;
+		break;
+	case 'L':
+		if ((fatpages = myatoi(&p)) < 2)
+		{
+			printf("Bad number in L option (2 or more)\n");
+			exit(1);
+		}
+		break;
+	case 'B':
+		if ((bcblocks = myatoi(&p)) <= 0)
+		{
+			printf("Bad number in B option\n");
+			exit(1);
+		}
+		break;
+	case 'K':
+		if ((hostbuf = myatoi(&p)) <= 0)
+		{
+			printf("Bad number in K option\n");
+			exit(1);
+		}
+		hostbuf *= 1024;
+		break;
+	case 'w':
+		if ((nworkers = myatoi(&p)) <= 0)
+		{
+			printf("Bad number in w option\n");
+			exit(1);
+		}
+		break;
 	case '-': continue;
 
 	default:
+		if (setflag(p[-1]))
+			break;
 		for (dtype = 0; dtypes[dtype].type != '\0'; dtype++)
 			if (p[-1] == dtypes[dtype].type)
 				break;
@@ -314,6 +604,7 @@ char **argv;
 		}
 		if (dtypes[dtype].type != '\0')
 		{
+			dgiven++;
 			if (verbose)
 				printf("%s\n",dtypes[dtype].tname);
 			continue;
@@ -327,128 +618,739 @@ char **argv;
 		if (clobber)
 			cmd = 'r';
 		else
-			erexit("One of [tcrxd] must be specified\n", 0);
+			erexit("One of [tcrxdzkublDAC] must be specified\n", 0);
+	}
+	if (overlay)
+	{
+		if (!nfiles--)
+			erexit("Usage: %s O device overlay [file ...]\n", argv[0]);
+		ovname = *files++;
 	}
 	if (!nfiles && cmd == 'd') {
 		clobber++;
 		cmd = 'c';
 	}
+	if ((cmd == 'D' && nfiles != 2) || (cmd == 'A' && nfiles != 1))
+		erexit("Usage: %s D old new delta, or A device delta\n", argv[0]);
+	if (cmd == 'C' && (nfiles == 0 || overlay))
+		erexit("Usage: %s C from to [file ...]\n", argv[0]);
+	if (*device == '@')
+	{
+		if (clobber || overlay || cmd == 'b' || cmd == 'l' || cmd == 'D'
+		 || cmd == 'C')
+			erexit("Can't do that to a list of images\n", 0);
+		multi(device+1);
+	}
 	opendevice();
+	if (cmd == 'b')
+		script(nfiles ? files[0] : "-");
+	else if (cmd == 'l')
+	{
+		if (nfiles != 1)
+			erexit("Usage: %s l device socket\n", argv[0]);
+		serve(files[0]);
+	}
+	else
+		runcmd();
+	dos_end();
+	exit(nerrors != 0);
+	/*NOTREACHED*/
+}
+
+/*
+ *	Set a flag from the key. Returns 0 if it isn't one.
+ */
+setflag(c)
+{
+	switch (c) {
+	case 'v':
+		verbose++;
+		break;
+	case 'a':
+		binary = 0;
+		break;
+	case 's':
+		sparse++;
+		break;
+	case 'n':
+		dryrun++;
+		break;
+	case 'h':
+		cmpdata++;
+		break;
+	case 'P':
+		prune++;
+		break;
+	case 'R':
+		recurse++;
+		break;
+	case 'q':
+		pipeline++;
+		break;
+	case 'T':
+	case 'N':
+	case 'J':
+		lformat = c;
+		break;
+	default:
+		return 0;
+	}
+	return 1;
+}
 
+/*
+ *	Do cmd to files on the open device
+ */
+void
+runcmd()
+{
+	ppop(0);		/* Whole device walks start from the top */
 	switch (cmd) {
-	case 't': listdir("",rootdir, NDIR); break;
-	case 'r': forall(replace); break;
-	case 'd': forall(delete); break;
+	case 't': pcompile();
+		  listdir(rootdir,NDIR,ptree ? &ptree : NULL,1);
+		  oflush();
+		  pfree(ptree);
+		  ptree = NULL;
+		  break;
+	case 'r': if (pipeline)
+			qforall();
+		  else
+			forall(replace);
+		  break;
+	case 'd': forall(delete);
+		  delflush();
+		  break;
 	case 'x': if (nfiles)
 			forall(extract);
 		  else
-			extrall("",rootdir,NDIR);
+			extrall(rootdir,NDIR);
 		  break;
+	case 'z': defrag(); break;
+	case 'k': check(); break;
+	case 'u': forall(update); break;
+	case 'D': mkdelta(files[0],files[1]); break;
+	case 'A': apdelta(files[0]); break;
+	case 'C': imcopy(); break;
 	}
-	dos_end();
-	exit(0);
-	/*NOTREACHED*/
 }
 
 /*
- *	Simple atoi for +ve numbers that advances the pointer.
+ *	Do cmd to each image named in the manifest (one per line, "-" for
+ *	standard input), up to nworkers at a time. Each image is done by a
+ *	child process with its own copy of all the disk state. Its output
+ *	is kept in a temporary file and copied out when it finishes, each
+ *	line tagged with the image name (T, N and J listings carry the name
+ *	as a field instead). Its error messages are kept apart, and copied
+ *	to stderr tagged the same way. Exit status is 1 if any image failed.
  */
-myatoi(pp)
-char	**pp;
+struct	worker
 {
-	register 	i = 0;
+	int	pid;
+	char	*name;
+	FILE	*out;
+	FILE	*err;
+};
 
-	if (**pp < '0' || **pp > '9')
-		return -1;
-	while (**pp >= '0' && **pp <= '9')
+void
+multi(manifest)
+char	*manifest;
+{
+	FILE	*fp;
+	char	line[BUFSIZ];
+	char	**names = NULL;
+	int	nnames = 0, next, running, failed, pid, status;
+	register struct	worker	*wp, *workers;
+	register char	*p;
+	char	*d;
+
+	if (strcmp(manifest,"-") == 0)
+		fp = stdin;
+	else if ((fp = fopen(manifest,"r")) == NULL)
 	{
-		i = i*10 + **pp-'0';
-		(*pp)++;
+		perror(manifest);
+		exit(1);
 	}
-	return i;
+	while (fgets(line,sizeof(line),fp) != NULL)
+	{
+		if ((p = strchr(line,'\n')) != NULL)
+			*p = '\0';
+		if (line[0] == '\0' || line[0] == '#')
+			continue;
+		if ((nnames&63) == 0)
+			names = (char **)(names
+			    ? realloc(names,(nnames+64)*sizeof(*names))
+			    : Malloc(64*sizeof(*names)));
+		if (names == NULL)
+			erexit("Help! Out of memory... aborting\n", 0);
+		names[nnames] = Malloc(strlen(line)+1);
+		strcpy(names[nnames++],line);
+	}
+	if (fp != stdin)
+		fclose(fp);
+
+	/*
+	 *	x can't put two images in the one directory
+	 */
+	if (cmd == 'x')
+		for (next = 0; next < nnames; next++)
+		{
+			p = xdir(names[next]);
+			for (running = 0; running < next; running++)
+			{
+				d = xdir(names[running]);
+				if (strcmp(p,d) == 0)
+					erexit("Two images would be extracted into %s\n",
+						p);
+				free(d);
+			}
+			free(p);
+		}
+
+	workers = (struct worker *)Malloc(nworkers*sizeof(*workers));
+	for (wp = workers; wp < workers+nworkers; wp++)
+		wp->pid = 0;
+	next = running = failed = 0;
+	while (next < nnames || running)
+	{
+		if (next < nnames && running < nworkers)
+		{
+			for (wp = workers; wp->pid != 0; wp++)
+				;
+			wp->name = names[next++];
+			if ((wp->out = tmpfile()) == NULL
+			 || (wp->err = tmpfile()) == NULL)
+				erexit("Can't make temporary file\n", 0);
+			fflush(stdout);
+			fflush(stderr);
+			if ((pid = fork()) < 0)
+			{
+				perror("fork");
+				exit(1);
+			}
+			if (pid == 0)
+			{
+				dup2(fileno(wp->out),1);
+				dup2(fileno(wp->err),2);
+				image(wp->name);
+				/*NOTREACHED*/
+			}
+			wp->pid = pid;
+			running++;
+			continue;
+		}
+
+		if ((pid = wait(&status)) < 0)
+			break;
+		for (wp = workers; wp < workers+nworkers; wp++)
+			if (wp->pid == pid)
+				break;
+		if (wp == workers+nworkers)
+			continue;
+		if (status != 0)
+			failed++;
+		rewind(wp->out);
+		if (lformat)
+			while ((status = fread(line,1,sizeof(line),wp->out)) > 0)
+				fwrite(line,1,status,stdout);
+		else
+			while (fgets(line,sizeof(line),wp->out) != NULL)
+				printf("%s: %s%s", wp->name, line,
+					strchr(line,'\n') ? "" : "\n");
+		fflush(stdout);
+		rewind(wp->err);
+		while (fgets(line,sizeof(line),wp->err) != NULL)
+			fprintf(stderr,"%s: %s%s", wp->name, line,
+				strchr(line,'\n') ? "" : "\n");
+		fclose(wp->out);
+		fclose(wp->err);
+		wp->pid = 0;
+		running--;
+	}
+	fflush(stdout);
+	exit(failed != 0);
+}
+
+/*
+ *	The directory x puts an image's files in: its last name, less
+ *	any suffix, in space from Malloc().
+ */
+char *
+xdir(name)
+char	*name;
+{
+	char	*d, *p;
+
+	d = strrchr(name,'/');
+	d = d ? d+1 : name;
+	p = Malloc(strlen(d)+1);
+	strcpy(p,d);
+	if ((d = strrchr(p,'.')) != NULL && d != p)
+		*d = '\0';
+	return p;
 }
 
+/*
+ *	Do cmd to one image from a manifest, in a child process.
+ *	x puts the files in a directory named after the image.
+ */
 void
-opendevice()
+image(name)
+char	*name;
 {
-	register dir	*vol;
-	register mode = 0;
+	char	*p;
 
-	if (cmd == 'c' || cmd == 'd' || cmd == 'r')
-		mode = 2;
-	if ((disk = open(device,mode)) < 0) {
-		if (!mode || errno != ENOENT) {
-		pe:	perror(device);
-			exit(1);
-		}
-		printf("Create %s (y or n) ?",device);
-		if (getchar() != 'y')
-			erexit("abort\n", 0);
-		while(getchar() != '\n');
-		close(disk);
-		if ((disk = creat(device,0666)) < 0)
-			goto pe;
-		close(disk);
-		if ((disk = open(device,mode)) < 0)
-			goto pe;
-		dos_format();
-		clobber++;
-	} else {
-		if (clobber) {
-			printf("Really clobber %s \7(y or n) ?",device);
-			if (getchar() != 'y')
-				erexit("aborted\n", 0);
-			while(getchar() != '\n');
-			dos_format();
-		} else
+	device = tag = name;
+	nocreate++;
+	opendevice();
+	if (cmd == 'x')
+	{
+		p = xdir(name);
+		mkdir(p,0777);
+		if (chdir(p) < 0)
 		{
-			vol = getdisk();
-			if (vol != NULL
-			 && verbose
-			 && !nfiles
-			 && cmd == 't')
-				printf("%s:\n",fixname(vol->name));
+			perror(p);
+			exit(1);
 		}
 	}
+	runcmd();
+	dos_end();
+	exit(nerrors != 0);
 }
 
+/*
+ *	Run each line of a script as a command, all on the one open device.
+ *	The FAT and root directory are only written back at the end.
+ */
 void
-forall(f)
-int	(*f)();
+script(name)
+char	*name;
 {
-	while (nfiles--)
-		(*f)(*files++);
+	FILE	*fp;
+	char	line[BUFSIZ];
+	int	lineno = 0;
+
+	if (strcmp(name,"-") == 0)
+		fp = stdin;
+	else if ((fp = fopen(name,"r")) == NULL)
+	{
+		perror(name);
+		nerrors++;
+		return;
+	}
+	saveflags();
+	while (fgets(line,sizeof(line),fp) != NULL)
+		if (!doline(line,name,++lineno))
+			break;
+	if (fp != stdin)
+		fclose(fp);
 }
 
-ucase(c)
+/*
+ *	Flags as given on the command line, for each script line to start with
+ */
+int	s_verbose, s_binary, s_sparse, s_dryrun, s_cmpdata, s_prune,
+	s_recurse, s_pipeline;
+char	s_lformat;
+
+void
+saveflags()
 {
-	if (c >= 'a' && c <= 'z')
-		return c+'A'-'a';
-	return c;
+	s_verbose = verbose; s_binary = binary; s_sparse = sparse;
+	s_dryrun = dryrun; s_cmpdata = cmpdata; s_prune = prune;
+	s_recurse = recurse; s_pipeline = pipeline; s_lformat = lformat;
 }
 
-lcase(c)
+void
+restflags()
 {
-	if (c >= 'A' && c <= 'Z')
-		return c+'a'-'A';
-	return c;
+	verbose = s_verbose; binary = s_binary; sparse = s_sparse;
+	dryrun = s_dryrun; cmpdata = s_cmpdata; prune = s_prune;
+	recurse = s_recurse; pipeline = s_pipeline; lformat = s_lformat;
 }
 
-void
-show(c,f)
-char	c, *f;
+/*
+ *	Do one line of a script.
+ *	A line is a key (one command and any flags) then the files,
+ *	separated by white space. Blank lines and lines starting with '#'
+ *	are skipped. The words "stat", "flush" and "quit" may also be used.
+ *	Returns 0 for "quit".
+ */
+#define	MAXARGS	256
+
+doline(line,name,lineno)
+char	*line, *name;
 {
-	if (verbose)
-		printf("%c - %s\n",c,f);
+	char	*args[MAXARGS];
+	register char	*p;
+	register int	n;
+
+	for (n = 0, p = strtok(line," \t\r\n");
+	     p != NULL && n < MAXARGS;
+	     p = strtok((char *)NULL," \t\r\n"))
+		args[n++] = p;
+	if (n == 0 || args[0][0] == '#')
+		return 1;
+	if (p != NULL)
+	{
+		printf("%s: line %d: too many files\n",name,lineno);
+		nerrors++;
+		return 1;
+	}
+
+	restflags();
+	files = args+1;
+	nfiles = n-1;
+	if (strcmp(args[0],"quit") == 0)
+		return 0;
+	if (strcmp(args[0],"flush") == 0)
+	{
+		dosflush();
+		return 1;
+	}
+	if (strcmp(args[0],"stat") == 0)
+	{
+		forall(statf);
+		fflush(stdout);
+		return 1;
+	}
+
+	cmd = 0;
+	for (p = args[0]; *p != '\0'; p++)
+	{
+		if (strchr("txrdzku",*p) != NULL && cmd == 0)
+			cmd = *p;
+		else if (*p != '-' && !setflag(*p))
+			break;
+	}
+	if (*p != '\0' || cmd == 0 || (cmd == 'd' && n == 1))
+	{
+		printf("%s: line %d: bad command '%s'\n",name,lineno,args[0]);
+		nerrors++;
+		return 1;
+	}
+	runcmd();
+	fflush(stdout);
+	restflags();
+	return 1;
 }
 
+/*
+ *	List one entry in machine readable form ('T' unless given)
+ */
 void
-replace(f)
+statf(f)
 char	*f;
 {
-	register start;
-	register fd, r;
-	register char	*p, *q;
+	dir	*dirp, *dp;
+	int	num, start;
+
+	if ((dp = lookup(f,&dirp,&num,&start)) == NULL)
+	{
+		printf("%s: not found\n",f);
+		nerrors++;
+		return;
+	}
+	pinit(f);
+	if (!lformat)
+		lformat = 'T';
+	lentry(dp);
+	oflush();
+	if (dirp != rootdir)
+		free(dirp);
+}
+
+/*
+ *	Write back the FAT and root directory now, and carry on
+ */
+void
+dosflush()
+{
+	dos_end();
+	root_mod = fat_mod = 0;
+}
+
+#ifndef	NOSERVER
+/*
+ *	Serve script lines from clients on a UNIX domain socket.
+ *	Each client gets the output of each of its lines, followed by a
+ *	line "." if all went well or "?" if not. Lines are done one at
+ *	a time, so clients may interleave but never see a half done change.
+ *	Changes are written back after FLUSHSECS idle, or MAXDIRTY after
+ *	the first one not yet written however busy the server is, on
+ *	"flush", and when the server stops on "quit" or a signal.
+ */
+#define	MAXCLIENTS	16
+#define	FLUSHSECS	5
+#define	MAXDIRTY	30
+
+struct	client
+{
+	int	fd;
+	int	len;
+	int	lineno;
+	char	buf[BUFSIZ];
+}	clients[MAXCLIENTS];
+int	stopping;
+
+void
+stopserve()
+{
+	stopping++;
+}
+
+void
+serve(path)
+char	*path;
+{
+	struct	sockaddr_un	addr;
+	struct	pollfd	pfd[MAXCLIENTS+1];
+	register struct	client	*cp;
+	register i;
+	int	lfd, fd, n, out, err, errs, wait;
+	char	*nl;
+	time_t	dirty = 0;	/* When the oldest unwritten change was made */
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		erexit("%s: socket name too long\n", path);
+	memset(&addr,0,sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path,path);
+	unlink(path);
+	if ((lfd = socket(AF_UNIX,SOCK_STREAM,0)) < 0
+	 || bind(lfd,(struct sockaddr *)&addr,sizeof(addr)) < 0
+	 || listen(lfd,5) < 0)
+	{
+		perror(path);
+		exit(1);
+	}
+	signal(SIGPIPE,SIG_IGN);
+	signal(SIGINT,stopserve);
+	signal(SIGTERM,stopserve);
+	for (cp = clients; cp < clients+MAXCLIENTS; cp++)
+		cp->fd = -1;
+	saveflags();
+
+	while (!stopping)
+	{
+		pfd[0].fd = lfd;
+		pfd[0].events = POLLIN;
+		for (i = 0; i < MAXCLIENTS; i++)
+		{
+			pfd[i+1].fd = clients[i].fd;
+			pfd[i+1].events = POLLIN;
+		}
+		wait = -1;
+		if (root_mod || fat_mod)
+		{
+			if (dirty == 0)
+				dirty = time((time_t *)0);
+			wait = dirty + MAXDIRTY - time((time_t *)0);
+			if (wait > FLUSHSECS)
+				wait = FLUSHSECS;
+			wait = wait > 0 ? wait*1000 : 0;
+		}
+		else
+			dirty = 0;	/* Written by "flush" */
+		n = poll(pfd,MAXCLIENTS+1,wait);
+		if (n == 0 || (dirty && time((time_t *)0) >= dirty + MAXDIRTY))
+		{
+			dosflush();
+			dirty = 0;
+		}
+		if (n <= 0)
+			continue;		/* Timed out, or EINTR */
+
+		if (pfd[0].revents & POLLIN)
+		{
+			if ((fd = accept(lfd,(struct sockaddr *)0,0)) >= 0)
+			{
+				for (cp = clients; cp < clients+MAXCLIENTS; cp++)
+					if (cp->fd < 0)
+						break;
+				if (cp == clients+MAXCLIENTS)
+					close(fd);	/* Too busy */
+				else
+				{
+					cp->fd = fd;
+					cp->len = 0;
+					cp->lineno = 0;
+				}
+			}
+		}
+
+		for (i = 0; i < MAXCLIENTS && !stopping; i++)
+		{
+			cp = &clients[i];
+			if (cp->fd < 0 || pfd[i+1].fd != cp->fd
+			 || (pfd[i+1].revents & (POLLIN|POLLHUP|POLLERR)) == 0)
+				continue;
+			n = read(cp->fd,cp->buf+cp->len,sizeof(cp->buf)-1-cp->len);
+			if (n <= 0)
+			{
+				close(cp->fd);
+				cp->fd = -1;
+				continue;
+			}
+			cp->len += n;
+			cp->buf[cp->len] = '\0';
+
+			/*
+			 *	Do each whole line, with stdout and stderr
+			 *	to the client
+			 */
+			fflush(stdout);
+			fflush(stderr);
+			out = dup(1);
+			err = dup(2);
+			dup2(cp->fd,1);
+			dup2(cp->fd,2);
+			while ((nl = strchr(cp->buf,'\n')) != NULL)
+			{
+				*nl++ = '\0';
+				errs = nerrors;
+				if (!doline(cp->buf,path,++cp->lineno))
+					stopping++;
+				fflush(stderr);
+				printf("%s\n",nerrors != errs ? "?" : ".");
+				nerrors = errs;
+				fflush(stdout);
+				cp->len -= nl-cp->buf;
+				memmove(cp->buf,nl,cp->len+1);
+			}
+			if (cp->len == sizeof(cp->buf)-1)
+			{
+				printf("%s: line too long\n?\n",path);
+				fflush(stdout);
+				cp->len = 0;
+			}
+			fflush(stderr);
+			dup2(out,1);
+			dup2(err,2);
+			close(out);
+			close(err);
+		}
+	}
+
+	for (cp = clients; cp < clients+MAXCLIENTS; cp++)
+		if (cp->fd >= 0)
+			close(cp->fd);
+	close(lfd);
+	unlink(path);
+}
+#else
+void
+serve(path)
+char	*path;
+{
+	erexit("Server mode not supported (compiled with NOSERVER)\n", 0);
+}
+#endif
+
+/*
+ *	Simple atoi for +ve numbers that advances the pointer.
+ */
+myatoi(pp)
+char	**pp;
+{
+	register 	i = 0;
+
+	if (**pp < '0' || **pp > '9')
+		return -1;
+	while (**pp >= '0' && **pp <= '9')
+	{
+		i = i*10 + **pp-'0';
+		(*pp)++;
+	}
+	return i;
+}
+
+void
+opendevice()
+{
+	register dir	*vol;
+	register mode = 0;
+
+	if (cmd == 'c' || cmd == 'd' || cmd == 'r' || cmd == 'u' || cmd == 'b'
+	 || cmd == 'l' || cmd == 'A'
+	 || (cmd == 'z' && !dryrun))
+		mode = 2;
+	if (overlay)
+		mode = 0;		/* Writes go to the overlay */
+	if ((disk = open(device,mode)) < 0) {
+		if (!mode || errno != ENOENT || nocreate) {
+		pe:	perror(device);
+			exit(1);
+		}
+		printf("Create %s (y or n) ?",device);
+		if (getchar() != 'y')
+			erexit("abort\n", 0);
+		while(getchar() != '\n');
+		close(disk);
+		if ((disk = creat(device,0666)) < 0)
+			goto pe;
+		close(disk);
+		if ((disk = open(device,mode)) < 0)
+			goto pe;
+		dos_format();
+		clobber++;
+	} else {
+		if (overlay)
+			ovopen();
+		if (clobber) {
+			printf("Really clobber %s \7(y or n) ?",device);
+			if (getchar() != 'y')
+				erexit("aborted\n", 0);
+			while(getchar() != '\n');
+			dos_format();
+		} else
+		{
+			vol = getdisk();
+			if (vol != NULL
+			 && verbose
+			 && !nfiles
+			 && cmd == 't')
+				printf("%s:\n",fixname(vol->name));
+		}
+	}
+}
+
+void
+forall(f)
+int	(*f)();
+{
+	while (nfiles--)
+		(*f)(*files++);
+}
+
+ucase(c)
+{
+	if (c >= 'a' && c <= 'z')
+		return c+'A'-'a';
+	return c;
+}
+
+lcase(c)
+{
+	if (c >= 'A' && c <= 'Z')
+		return c+'a'-'A';
+	return c;
+}
+
+void
+show(c,f)
+char	c, *f;
+{
+	if (verbose)
+		printf("%c - %s\n",c,f);
+}
+
+void
+replace(f)
+char	*f;
+{
+	register start = 0;
+	register fd = -1, r;
+	register char	*p, *q;
 	char	op = 'r';	/* May get changed to 'u' */
 	int	ret = 0;
 	char	*namepart = f;
@@ -459,18 +1361,22 @@ char	*f;
 	char	*buf;
 	char	*buf1;
 	int	clus = 0, new;
+	int	oldstart = 0, old = 0;	/* Chain of the file being replaced */
+	dir	*found = NULL;
 	long	df;
 	long	a;
 	struct	stat	sb;
 	long	new_size;
+	long	bsize;
+	char	want[11];
 
 	/*
 	 *	Make sure we can access the file, and get some info
 	 */
-	if (access(f,04) != 0
-	 || stat(f,&sb) != 0)
+	if (qon ? qstat(&sb) != 0 : access(f,04) != 0 || stat(f,&sb) != 0)
 	{
 		perror(f);
+		nerrors++;
 		return;
 	}
 	new_size = sb.st_size;
@@ -479,6 +1385,7 @@ char	*f;
 	end = strchr(namepart,'/');
 	if (end != NULL)
 		*end = '\0';
+	dosname(want,namepart);
 	/*
 	 *	Search for the file/subdirectory 'namepart'
 	 */
@@ -486,7 +1393,7 @@ char	*f;
 	{
 		if (dp->name[0] == 0)
 			break;
-		if (strcmp(namepart,fixname(dp->name)))
+		if (strncmp(want,dp->name,11))
 			continue;
 		/*
 		 *	Found current part of pathname
@@ -496,10 +1403,12 @@ char	*f;
 			if (end == NULL)
 			{
 				if ((sb.st_mode&S_IFMT) != S_IFDIR)
+				{
 					printf("%s: Directory in path\n",f);
+					nerrors++;
+				}
 				else if (verbose)
 					printf("%s: Directory exists\n",f);
-				*end = '/';	/* Restore the / */
 				if (dirp != rootdir)
 					free(dirp);
 				return;
@@ -507,7 +1416,7 @@ char	*f;
 			/*
 			 *	Load in the directory
 			 */
-			start = dp->start;
+			start = dstart(dp);
 			if (dirp != rootdir)
 				free(dirp);
 			dirp = dp = getdir(start);
@@ -521,6 +1430,7 @@ char	*f;
 		{
 			/* ... but we expect a directory */
 			printf("%s is not a directory\n",f);
+			nerrors++;
 			*end = '/';
 			if (dirp != rootdir)
 				free(dirp);
@@ -529,17 +1439,20 @@ char	*f;
 		else
 		{
 			/*
-			 *	The file already exists
-			 *	Delete it, then put new one.
+			 *	The file already exists.
+			 *	Put the new one in the same entry, reusing its
+			 *	clusters as far as they go.
 			 */
 			op = 'u';
-			truncate(dp->start);
-			dp->name[0] = 0xE5;
+			oldstart = dstart(dp);
+			found = dp;
 			break;
 		}
 	}
 
 	df = diskfree();
+	for (new = oldstart; new >= 2 && new < 0xFF7; new = getfat(new))
+		df += CLUSIZE;		/* Old clusters will be reused */
 
 	if (df < new_size)
 		/*
@@ -550,11 +1463,18 @@ char	*f;
 		 */
 		goto room;
 
-	if ((fd = open(f,0)) < 0)
+	if (qon)
+		fd = QFD;	/* The reader thread has it */
+	else if ((fd = open(f,0)) < 0)
 		/* We checked for this before */
 		erexit("%s: Impossible open error\n",f);
+#ifdef	POSIX_FADV_SEQUENTIAL
+	else
+		posix_fadvise(fd,0L,0L,POSIX_FADV_SEQUENTIAL);
+#endif
 
-	buf = Malloc(CLUSIZE);
+	bsize = hostsize(sb.st_size);
+	buf = Malloc(bsize);
 	if (!binary)
 		buf1 = Malloc(CLUSIZE);
 
@@ -563,34 +1483,19 @@ char	*f;
 	 */
 	if (!binary)
 	{
-		new_size = 0;
-		while ((r = read(fd,buf,CLUSIZE)) > 0)
-		{
-			for (p = buf; p < buf+r; p++)
-			{
-				if (*p == '\n' && !ret)
-				{
-					new_size++;
-					p--;	/* Don't advance p */
-					ret = 1;
-				}
-				else if (*p == '\r')
-				{
-					ret = 0;
-					new_size++;
-				}
-				else
-					new_size++;
-			}
-		}
-
-		if (r < 0)
+		if (fd == QFD)
+			new_size = qasize;
+		else if ((sb.st_mode&S_IFMT) == S_IFDIR)
+			new_size = 0;		/* Nothing to read */
+		else if ((new_size = asize(fd,buf,bsize)) >= 0)
+			lseek(fd, 0L, 0);	/* Back to start */
+
+		if (new_size < 0)
 		{			/* Read error */
 			perror(f);
+			nerrors++;
 			goto pd;
 		}
-
-		lseek(fd, 0L, 0);	/* Back to start */
 	}
 
 	if (df < new_size)
@@ -599,7 +1504,9 @@ char	*f;
 	/*
 	 *	Find a slot
 	 */
-	for (dp = dirp; dp <= dirp+num; dp++)
+	if (found != NULL)
+		dp = found;
+	else for (dp = dirp; dp <= dirp+num; dp++)
 		if (dp->name[0] == (char)0xE5 || dp->name[0] == 0)
 			break;
 	if (dp == dirp+num)
@@ -609,6 +1516,7 @@ char	*f;
 		if (dirp == rootdir)
 		{
 			printf("%s: No more room in root directory\n",f);
+			nerrors++;
 			goto pd;
 		}
 	}
@@ -619,6 +1527,7 @@ char	*f;
 	if (df < new_size)
 	{
 	room:	printf("No room to add file %s\n",f);
+		nerrors++;
 		goto pd;
 	}
 
@@ -628,62 +1537,36 @@ char	*f;
 
 	/* Build the directory entry */
 	makeent(dp,namepart,&sb);
+	old = oldstart;		/* Whatever isn't reused is freed at the end */
 
 	/*
 	 *	If what we want is a subdirectory, make it.
 	 */
 	if (dp->attr&DIRECT || end != NULL)
 	{
-		register char *cp;
-		dir	*newdir;
-
 		/*
-		 *	Create empty directory and move to it
+		 *	Create empty directory (written out, so that if
+		 *	something bad happens it's at least consistent)
+		 *	and move to it
 		 */
 		dp->attr |= DIRECT;
-		newdir = (dir *)Malloc(CLUSIZE);
-		makedir(newdir,".");
-		if ((newdir->start = getfree()) == 0)
+		setsize(dp,0);
+		if ((new = newdclus(start)) == 0)
 		{
-			free(newdir);
 			dp->name[0] = 0xE5; /* Delete the entry for the dir */
 			goto room;
 		}
-		/* Mark the block used */
-		putfat(dp->start = newdir->start, 0xFF8);
-		makedir(newdir+1,"..");
-		newdir[1].start = dp->start;
+		setstart(dp,new);
 
 		/* finish with parent */
 	 	putdir(start,dirp,num);
 		if (dirp != rootdir)
 			free(dirp);
 		/* Move to new */
-		dp = dirp = newdir;
-		num = DPCLUS;
-		start = newdir->start;
-		/*
-		 *	Initialize remaining entries properly
-		 */
-		cp = (char *)(newdir+2);
-		while (cp < (char *)newdir+CLUSIZE)
-			*cp++ = 0xE5;
-
-		for (dp = newdir+2; dp < rootdir+DPCLUS; dp++)
-			dp->name[0] = 0;
-		dp = dirp;
+		dp = dirp = getdir(start = new);
+		num = getdir_num;
 		if (end != NULL)
 		{		/* Made a directory inside path */
-			/*
-			 *	Write it out, so that if something bad happens
-			 *	it's at least consistent
-			 */
-			putdir(start,dirp,num);
-			/*
-			 *	putdir fixed it for writing;
-			 *	fix it back again
-			 */
-			fixdir(dirp,num);
 			*end = '/';
 			namepart = end+1;
 			goto again;
@@ -699,41 +1582,28 @@ char	*f;
 	if (new_size == 0)
 		goto pd;		/* Zero size file */
 
-	dp->start = 0;		/* Say no clusters allocated yet */
+	setstart(dp,0);		/* Say no clusters allocated yet */
 	q = buf1;
 	ret = 0;
 	a = 0;
-	while ((r = read(fd,buf,CLUSIZE)) > 0)
+	while ((r = hostread(fd,buf,bsize)) > 0)
 	{
-		if (r < CLUSIZE && binary)
-		{		/* Null pad buffer */
-			p = buf+r;
-			while (p < buf+CLUSIZE)
-				*p++ = 0;
-		}
 		if (binary)
 		{		/* No crushing of cr-nl's */
-		newclus1:
-			new = getfree();
-			if (!new)
+			p = buf+r;	/* Null pad the last cluster */
+			while ((p-buf)%CLUSIZE)
+				*p++ = 0;
+			for (p = buf; p < buf+r; p += CLUSIZE, clus = new)
+				if ((new = addclus(dp,clus,p,&old)) == 0)
+					break;
+			a += p < buf+r ? p-buf : r;
+			if (p < buf+r)
 			{
 		quit:
 			    printf("%s: Out of space due to bad blocks\n",f);
+			    nerrors++;
 			    break;
 			}
-			if (!writeclus(new,buf))
-			{		/* Write error - mark cluster bad */
-				printf("Marking cluster bad\n");
-				putfat(new,0xFF7);
-				goto newclus1;
-			}
-			if (dp->start)
-				putfat(clus,new);
-			else
-				dp->start = new;
-			putfat(new,0xFF8);	/* Mark eof */
-			clus = new;
-			a += r;
 			continue;
 		}
 		/*
@@ -756,21 +1626,9 @@ char	*f;
 				ret = 0;
 			/* Time to flush output buffer ? */
 			if (q == buf1+CLUSIZE) {
-			newclus2:
-				new = getfree();
-				if (!new)
+				if ((new = addclus(dp,clus,buf1,&old)) == 0)
 					goto quit;
-				if (!writeclus(new,buf1))
-				{	/* Write error - mark cluster bad */
-					printf("Marking cluster bad\n");
-					putfat(new,0xFF7);
-					goto newclus2;
-				}
-				if (dp->start)
-					putfat(clus,new);
-				else
-					dp->start = new;	/* First clus */
-				putfat(clus = new,0xFF8);	/* Mark eof */
+				clus = new;
 				a += CLUSIZE;
 				q = buf1;
 			}
@@ -780,32 +1638,25 @@ char	*f;
 	if (r < 0)
 	{		/* Read error */
 		perror(f);
+		nerrors++;
 		goto pd;
 	}
 
 	/* set size written field */
 	if (!binary)
-		dp->size = a+q-buf1;
+		setsize(dp,a+q-buf1);
 	else
-		dp->size = a;
+		setsize(dp,a);
 
 	if (!binary && q != buf1)
 	{		/* flush buf1 */
 		while (q < buf1+CLUSIZE)
 			*q++ = 0;	/* Null pad */
-		new = getfree();
-		if (new)
+		if ((clus = addclus(dp,clus,buf1,&old)) == 0)
 		{
-			if (dp->start)
-				putfat(clus,new);
-			else
-				dp->start = new;
-			putfat(clus = new,0xFF8);	/* Mark eof */
-			if (!writeclus(clus,buf1))
-				printf("Ignored\n");
-		}
-		else
 			printf("%s: Out of space due to bad blocks\n",f);
+			nerrors++;
+		}
 	}
 	free(buf);
 	if (!binary)
@@ -814,9 +1665,58 @@ char	*f;
 	/*
 	 *	Write out the directory
 	 */
- pd:	putdir(start,dirp,num);
+ pd:	truncate(old);		/* Old clusters not reused */
+	putdir(start,dirp,num);
 	if (dirp != rootdir)
 		free(dirp);
+	if (fd >= 0)
+		close(fd);
+}
+
+/*
+ *	Add a cluster holding data to dp's chain after clus.
+ *	The next cluster of the old chain *oldp is used while there is one,
+ *	and with 'h' isn't written if it holds the same data already.
+ *	Returns the cluster, or 0 if the disk is full.
+ */
+char	*cmpbuf;
+
+addclus(dp,clus,data,oldp)
+dir	*dp;
+char	*data;
+int	*oldp;
+{
+	int	new;
+
+	for (;;)
+	{
+		if (*oldp >= 2 && *oldp < 0xFF7)
+		{
+			new = *oldp;
+			*oldp = getfat(new);
+			if (cmpdata)
+			{
+				if (cmpbuf == NULL)
+					cmpbuf = Malloc(CLUSIZE);
+				if (readclus(new,cmpbuf)
+				 && memcmp(cmpbuf,data,CLUSIZE) == 0)
+					break;		/* Unchanged */
+			}
+		}
+		else if ((new = getfree()) == 0)
+			return 0;
+		if (writeclus(new,data))
+			break;
+		/* Write error - mark cluster bad */
+		printf("Marking cluster bad\n");
+		putfat(new,0xFF7);
+	}
+	if (dstart(dp))
+		putfat(clus,new);
+	else
+		setstart(dp,new);	/* First clus */
+	putfat(new,0xFF8);		/* Mark eof */
+	return new;
 }
 
 /*
@@ -839,14 +1739,10 @@ char	*name;
 	dp->attr = DIRECT;
 	for (p = dp->fill; p < dp->fill+10; *p++ = 0)
 		;
-	dp->hour = 0;
-	dp->minute = 0;
-	dp->second = 0;
-	dp->year = 0;
-	dp->month = 0;
-	dp->day = 0;
-	dp->size = 0;
-	dp->start = 0;
+	settwo(dp->time,0);
+	settwo(dp->date,0);
+	setsize(dp,0);
+	setstart(dp,0);
 }
 
 /*
@@ -861,16 +1757,7 @@ struct	stat	*sb;
 	register char	*p;
 	struct	tm	*tm;
 
-	/* Build the MSDOS name */
-	for (p = dp->name; p < dp->name+11;)
-	{
-		if (p == dp->name+8 && *name == '.')
-			name++;
-		if (*name != '\0' && *name != '.')
-			*p++ = ucase(*name++);
-		else
-			*p++ = ' ';
-	}
+	dosname(dp->name,name);
 
 	/* Set attr */
 	dp->attr = ARCHIVE;
@@ -882,18 +1769,36 @@ struct	stat	*sb;
 
 	/* Set time */
 	tm = localtime(&sb->st_mtime);
-	dp->hour = tm->tm_hour;
-	dp->minute = tm->tm_min;
-	dp->second = tm->tm_sec;
-	dp->year = tm->tm_year-80;
-	dp->month = tm->tm_mon+1;
-	dp->day = tm->tm_mday;
-
-	dp->start = 0;		/* Starting cluster */
+	settwo(dp->time, tm->tm_hour<<11 | tm->tm_min<<5 | tm->tm_sec/2);
+	settwo(dp->date, (tm->tm_year-80)<<9 | (tm->tm_mon+1)<<5 | tm->tm_mday);
+
+	setstart(dp,0);		/* Starting cluster */
 	if (dp->attr&DIRECT)
-		dp->size = 0;
+		setsize(dp,0);
 	else
-		dp->size = sb->st_size;
+		setsize(dp,sb->st_size);
+}
+
+/*
+ *	Build the 11 character MSDOS name for a UNIX name
+ */
+void
+dosname(p,name)
+register char	*p;
+register char	*name;
+{
+	register char	*end = p+11;
+	char	*ext = p+8;
+
+	while (p < end)
+	{
+		if (p == ext && *name == '.')
+			name++;
+		if (*name != '\0' && *name != '.')
+			*p++ = ucase(*name++);
+		else
+			*p++ = ' ';
+	}
 }
 
 /*
@@ -909,6 +1814,7 @@ char	*f;
 	int	num = NDIR;
 	dir	*dp = rootdir;
 	dir	*dirp = rootdir;
+	dir	ent;
 
  again:
 	end = strchr(namepart,'/');
@@ -929,14 +1835,21 @@ char	*f;
 			/*
 			 *	Load in the directory
 			 */
-			start = dp->start;
+			ent = *dp;
+			start = dstart(dp);
 			if (dirp != rootdir)
 				free(dirp);
 			dp = getdir(start);
 			num = getdir_num;
 			if (end == NULL)
 			{		/* Extract whole directory */
-				extrall(f,dp,num);
+				pinit(f);
+				if (makepath(pathbuf,1) == 0)
+				{
+					extrall(dp,num);
+					settime(pathbuf,-1,&ent);
+				}
+				free(dp);
 				return;
 			}
 			*end = '/';	/* Restore the / */
@@ -948,6 +1861,7 @@ char	*f;
 		{
 			/* ... but we expect a directory */
 			printf("%s is not a directory\n",f);
+			nerrors++;
 			*end = '/';
 		}
 		else
@@ -958,20 +1872,19 @@ char	*f;
 	 *	Search failed
 	 */
 	printf("%s doesn't exist\n",f);
+	nerrors++;
 }
 
 /*
- *	Given the pathname of a directory and
- *	the actual contents of the directory,
- *	recursively extract every file and directory from it
+ *	Given the actual contents of a directory whose pathname is
+ *	in pathbuf, recursively extract every file and directory from it
  */
 void
-extrall(prefix,dp,num)
-char	*prefix;
+extrall(dp,num)
 dir	*dp;
 {
 	register i;
-	char	newprefix[130];
+	int	old;
 	dir	*sub;
 
 	for (i = 0; i < num; i++, dp++)
@@ -983,25 +1896,22 @@ dir	*dp;
 		if (dp->attr&VOLUME)
 			continue;
 
-		newprefix[0] = '\0';
-		if (prefix[0] != '\0')
-		{
-			strcpy(newprefix,prefix);
-			strcat(newprefix,"/");
-		}
-		strcat(newprefix,fixname(dp->name));
+		old = ppush(fixname(dp->name));
 		if (dp->attr&DIRECT)
 		{
-			if (dp->name[0] != '.')
+			if (dp->name[0] != '.' && makepath(pathbuf,1) == 0)
 			{
-				show('x',newprefix);
-				sub = getdir(dp->start);
-				extrall(newprefix,sub,getdir_num);
+				show('x',pathbuf);
+				sub = getdir(dstart(dp));
+				extrall(sub,getdir_num);
 				free(sub);
+				/* After the contents, which change it */
+				settime(pathbuf,-1,dp);
 			}
 		}
 		else
-			do_extract(newprefix,dp);
+			do_extract(pathbuf,dp);
+		ppop(old);
 	}
 }
 
@@ -1023,11 +1933,10 @@ dir	*dp;
 	int	fd;
 	int	clus;
 	int	mode;
-	int	r;
+	int	n;
+	long	r, run, got, bsize;
+	long	len = 0;	/* Bytes put into the UNIX file */
 	char	*p, *q;
-	/*		This is here for when we restore mod times to UNIX
-	time_t	tb[2];
-	 */
 
 	if (dp->attr&RONLY)
 		mode = 0444;
@@ -1037,748 +1946,3632 @@ dir	*dp;
 	if (fd < 0)
 		return;
 
-	buf = Malloc(CLUSIZE);
-	buf1 = Malloc(CLUSIZE);
-	for (
-		clus = dp->start, addr = 0;
-		addr < dp->size;
-		addr += CLUSIZE, clus = getfat(clus)
-	)
-	{
-		readclus(clus,buf);
-		r = CLUSIZE;
-		if (addr+CLUSIZE > dp->size)	/* Less than 1 block left */
-			/* Don't worry if lint complains about this */
-			r = (int)(dp->size-addr);
-		if (!binary) {
-			/*
-			 *	Do cr-nl mapping
-			 */
+	clus = dstart(dp);
+	addr = 0;
+	/*
+	 *	In binary mode, have the kernel copy each run of consecutive
+	 *	clusters straight from the device into the file.
+	 *	Whatever it can't do gets copied the slow way below.
+	 */
+	if (binary && !sparse && ovfd < 0)	/* Kernel can't see overlay */
+		for (bcflush(0); addr < dsize(dp); )
+		{
+			for (n = 1;
+			     addr+(long)n*CLUSIZE < dsize(dp)
+			  && getfat(clus+n-1) == clus+n;
+			     n++)
+				;
+			run = (long)n*CLUSIZE;
+			if (addr+run > dsize(dp))
+				run = dsize(dp)-addr;
+			if (!kcopy(fd,(long)(clus-2)*CLUSIZE + database,run))
+			{
+				lseek(fd,addr,0);	/* Undo any part copy */
+				break;
+			}
+			addr += run;
+			clus = getfat(clus+n-1);
+		}
+
+	/*
+	 *	Gather clusters into a big buffer, reading runs of them at once,
+	 *	and write that.
+	 */
+	bsize = hostsize(dsize(dp)-addr);
+	buf = Malloc(bsize);
+	buf1 = Malloc(bsize);
+	bcflush(0);		/* Runs are read past the cache */
+	while (addr < dsize(dp))
+	{
+		for (got = 0; got < bsize && addr+got < dsize(dp); got += run)
+		{
+			for (n = 1;
+			     got+(long)n*CLUSIZE < bsize
+			  && addr+got+(long)n*CLUSIZE < dsize(dp)
+			  && getfat(clus+n-1) == clus+n;
+			     n++)
+				;
+			run = (long)n*CLUSIZE;
+			if (dread((long)(clus-2)*CLUSIZE + database,buf+got,run)
+			    != run)
+			{
+				fprintf(stderr,
+				    "Read error on clusters %d to %d ignored\n",
+				    clus,clus+n-1);
+				memset(buf+got,0,run);
+			}
+			clus = getfat(clus+n-1);
+		}
+		r = got;
+		if (addr+got > dsize(dp))	/* Less than 1 block left */
+			r = dsize(dp)-addr;
+		addr += got;
+		if (!binary) {
+			/*
+			 *	Do cr-nl mapping
+			 */
 			for (p = buf, q = buf1; p < buf+r; p++)
 			{
 				if (*p == '\r')
 					*q++ = '\n';
-				else if (*p == '\032')
-					break;	/* ^Z is end of file char */
+				else if (*p == '\032')	/* ^Z is end of file char */
+					p = buf + ((p-buf)/CLUSIZE+1)*CLUSIZE - 1;
 				else if (*p != '\n')
 					*q++ = *p;
 			}
 
-			if (write(fd,buf1,q-buf1) != q-buf1) {
+			if (!putout(fd,buf1,(long)(q-buf1))) {
 				printf("Write error on %s\n",unixname);
 				break;
 			}
-		} else if (write(fd,buf,r) != r) {
+			len += q-buf1;
+		} else if (!putout(fd,buf,r)) {
 			printf("Write error on %s\n",unixname);
 			break;
-		}
+		} else
+			len += r;
 	}
+	/*
+	 *	A trailing hole doesn't extend the file by itself
+	 */
+	if (sparse && ftruncate(fd,len) < 0)
+		perror(unixname);
+	settime(unixname,fd,dp);
 	close(fd);
 	free(buf);
 	free(buf1);
 	show('x', unixname);
-
-	/*
-	 *	No code to calculate mtime yet!
-	 *	Sorry ...
-	 *
-	tb[0] = mtime;
-	tb[1] = mtime;
-	utime(unixname,tb);	* Set modified time */
 }
 
-makefile(name,mode)
+/*
+ *	Give a UNIX file or directory the time from its MSDOS entry,
+ *	through fd if it's open (>= 0) or else by name.
+ */
+void
+settime(name,fd,dp)
 char	*name;
+dir	*dp;
 {
-	register char	*p = name;
-	register of;
-	struct	stat	stbuf;
-	char	*strchr();
+	struct	timespec	ts[2];
 
-	while ((p = strchr(p,'/')) != NULL) {
-		*p = '\0';
-		if (stat(name,&stbuf) < 0	/* dir doesn't exist */
-		 || mkdir(name, 0777))
-		{
-			fprintf(stderr, "Unable to make directory %s\n", name);
-			return -1;
-		}
-		else if ((stbuf.st_mode&S_IFMT) != S_IFDIR) {
-			fprintf(stderr,"File in path: %s\n",name);
-			return -1;
-		}
-		*p++ = '/';
-	}
-	of = creat(name,mode);
-	if (of < 0)
+	if (dmonth(dp) == 0 || dday(dp) == 0)
+		return;		/* No time was ever set, e.g. by makedir() */
+	ts[0].tv_sec = ts[1].tv_sec = dostime(dp);
+	ts[0].tv_nsec = ts[1].tv_nsec = 0;
+	if (fd >= 0 ? futimens(fd,ts) : utimensat(AT_FDCWD,name,ts,0))
 		perror(name);
-	return of;
 }
 
 /*
-mkdir(n, mode)
-char	*n;
+ *	Turn the packed date and time of an entry into a UNIX time.
+ *	Like makeent(), this takes MSDOS time as local time.
+ */
+time_t
+dostime(dp)
+dir	*dp;
 {
-	char	buf[120];
-
-	strcpy(buf,"mkdir ");
-	strcat(buf,n);
-	return system(buf);
+	struct	tm	tm;
+
+	memset(&tm,0,sizeof(tm));
+	tm.tm_year = dyear(dp)+80;
+	tm.tm_mon = dmonth(dp)-1;
+	tm.tm_mday = dday(dp);
+	tm.tm_hour = dhour(dp);
+	tm.tm_min = dminute(dp);
+	tm.tm_sec = dsecond(dp)*2;
+	tm.tm_isdst = -1;	/* mktime() works out summer time */
+	return mktime(&tm);
 }
-*/
 
-void
-delete(f)
-char	*f;
+/*
+ *	Write a chunk of an extracted file.
+ *	With the 's' flag, each cluster of zeros is skipped over with a
+ *	seek, leaving a hole in the UNIX file.
+ */
+putout(fd,buf,n)
+char	*buf;
+long	n;
 {
-	register start = 0;
-	char	*namepart = f;
-	char	*end;
-	int	num = NDIR;
-	dir	*dp = rootdir;
-	dir	*dirp = rootdir;
+	register long	i, j, c;
+	int	z;
 
- again:
-	end = strchr(namepart,'/');
-	if (end != NULL)
-		*end = '\0';
-	/*
-	 *	Search for the file/subdirectory 'namepart'
-	 */
-	for (; dp < dirp+num; dp++)
+	if (!sparse)
+		return write(fd,buf,n) == n;
+	for (i = 0; i < n; i = j)
 	{
-		if (strcmp(namepart,fixname(dp->name)))
-			continue;
-		/*
-		 *	Found current part of pathname
-		 */
-		if (dp->attr&DIRECT)
-		{
-			int	pnum = num, pclus = start;
-			dir	*parent = dirp, *entry = dp;
-			/*
-			 *	Load in the directory
-			 */
-			start = dp->start;
-			if (end != NULL && dirp != rootdir)
-				free(dirp);
-			dirp = dp = getdir(start);
-			num = getdir_num;
-			if (end == NULL)
-			{		/* Delete whole directory */
-				/*
-				 *	Check that directory is empty
-				 *	(apart from "." and "..")
-				 */
-				for (;dp < dirp+num; dp++)
-				{
-					if (dp->name[0] == 0)
-						break;	/* Never used */
-					if (dp->name[0] != '.'
-					 && dp->name[0] != (char)0xE5)
-					{
-						printf("%s: Directory not empty\n",f);
-						free(dirp);
-						if (parent != rootdir)
-							free(parent);
-						return;
-					}
-				}
-				show('d',f);
-				/* Free the directory's blocks */
-				truncate(start);
-				free(dirp);
-				/* Delete entry from parent */
-				entry->name[0] = 0xE5;
-				putdir(pclus,parent,pnum);
-				if (parent != rootdir)
-					free(parent);
-				return;
-			}
-			*end = '/';	/* Restore the / */
-			namepart = end+1;
-			goto again;
-		}
-		/* It's a file */
-		if (end != NULL)
+		c = n-i < CLUSIZE ? n-i : CLUSIZE;
+		z = iszero(buf+i,c);
+		for (j = i+c; j < n; j += c)
 		{
-			/* ... but we expect a directory */
-			printf("%s is not a directory\n",f);
-			*end = '/';
-			return;
+			c = n-j < CLUSIZE ? n-j : CLUSIZE;
+			if (iszero(buf+j,c) != z)
+				break;
 		}
-		show('d',f);
-		truncate(dp->start);	/* Free the files clusters */
-		dp->name[0] = 0xE5;	/* Delete the file */
-		putdir(start,dirp,num);	/* Rewrite the directory */
-		if (dirp != rootdir)
-			free(dirp);
-		return;
+		if (z ? lseek(fd,j-i,1) == -1 : write(fd,buf+i,j-i) != j-i)
+			return 0;
 	}
-	/*
-	 *	Search failed
-	 */
-	printf("%s doesn't exist\n",f);
+	return 1;
 }
 
 /*
- *	Given the pathname of a directory and
- *	the actual contents of the directory,
- *	list out either:
- *		the contents of the directory and it's subdirectories
- *		The named files and/or directories
+ *	How big a buffer to use for size bytes of a UNIX file: a whole
+ *	number of clusters, no more than 'K' allows or the file needs.
  */
-void
-listdir(prefix,direct, num)
-char	*prefix;
-dir	*direct;
+long
+hostsize(size)
+long	size;
 {
-	register i, j;
-	register dir	*dp = direct;
-	register dir	*sub;
-	char	fullname[130];
-	static	struct
-	{
-		char	bit;
-		char	flag;
-	}	flags[] =
-	{
-		{ DIRECT, 'd' },
-		{ RONLY, 'r' },
-		{ HIDDEN, 'h' },
-		{ SYSTEM, 's' },
-		{ 0,	0 },
-		{ ARCHIVE, 'a' }
-	};
+	long	n = hostbuf/CLUSIZE;
 
-	for (j = 0; j < num; j++, dp++)
-	{
-		if (dp->name[0] == 0)
-			break;
-		if (dp->name[0] == (char)0xE5)
-			continue;
-		if (dp->attr&VOLUME)
-			continue;
-		fullname[0] = '\0';
-		if (prefix[0] != '\0')
-		{
-			strcpy(fullname,prefix);
-			strcat(fullname,"/");
-		}
-		strcat(fullname,fixname(dp->name));
-		if (ismatch(fullname) != 2)
-			continue;
-		/* Don't show directory if we'll show contents */
-		if (nfiles && dp->attr&DIRECT)
-			continue;
-		/*
-		 *	Don't list . and ..
-		 */
-		if (dp->name[0] == '.')
-			continue;
+	if (n > (size+CLUSIZE-1)/CLUSIZE)
+		n = (size+CLUSIZE-1)/CLUSIZE;
+	if (n < 1)
+		n = 1;
+	return n*CLUSIZE;
+}
 
-		if (verbose)
-		{
-			for (i = 0; flags[i].bit; i++)
-				if (dp->attr & flags[i].bit)
-					putchar(flags[i].flag);
-				else
-					putchar('-');
+/*
+ *	Fill a buffer from a UNIX file, short only at the end
+ */
+long
+hostread(fd,buf,n)
+char	*buf;
+long	n;
+{
+	long	got = 0, r = 0;
 
-			printf(" %02d:%02d:%02d %02d/%02d/%02d ",
-				dp->hour,dp->minute,dp->second*2,
-				dp->day,dp->month,1980+dp->year);
+	if (fd == QFD)
+		return qread(buf,n);
+	while (got < n && (r = read(fd,buf+got,n-got)) > 0)
+		got += r;
+	return got ? got : r;
+}
 
-			if (dp->attr&DIRECT)
-				printf("        ");
-			else
-				printf("%8ld ",dp->size);
-		}
-		else if (*prefix != '\0')
-			printf("%s/",prefix);
+/*
+ *	Size of a UNIX file in ascii mode, with '\r's put in,
+ *	reading it n bytes at a time into buf. -1 on a read error.
+ */
+long
+asize(fd,buf,n)
+char	*buf;
+long	n;
+{
+	register char	*p;
+	long	r, size = 0;
+	int	ret = 0;
 
-		printf("%s\n",fixname(dp->name));
-	}
-	/*
-	 *	List out subdirectories
-	 */
-	for (dp = direct, j = 0; j < num; j++, dp++)
+	while ((r = read(fd,buf,n)) > 0)
 	{
-		if (dp->name[0] == 0)
-			break;
-		if (dp->name[0] == (char)0xE5)
-			continue;
-		if ((dp->attr&DIRECT) == 0)
-			continue;
-		/* Don't go recursive on . and .. ! */
-		if (dp->name[0] == '.')
-			continue;
-		fullname[0] = '\0';
-		if (prefix[0] != '\0')
+		for (p = buf; p < buf+r; p++)
 		{
-			strcpy(fullname,prefix);
-			strcat(fullname,"/");
+			if (*p == '\n' && !ret)
+			{
+				size++;
+				p--;	/* Don't advance p */
+				ret = 1;
+			}
+			else if (*p == '\r')
+			{
+				ret = 0;
+				size++;
+			}
+			else
+				size++;
 		}
-		strcat(fullname,fixname(dp->name));
-		i = ismatch(fullname);
-		if (i == 0)
-			continue;
-		if (verbose)
-			printf("\n%s:\n",fullname);
-		sub = getdir(dp->start);
-		listdir(fullname,sub,getdir_num);
-		free(sub);
 	}
+	return r < 0 ? -1 : size;
 }
 
 /*
- *	Given the starting cluster of a directory,
- *	read the directory into Malloc'ed space and return it,
- *	setting getdir_num to the maximum number of entries.
+ *	Pipelined replace.
+ *	With 'q', a reader thread goes through the files ahead of replace(),
+ *	checking, stat()ing and opening each one and reading it in pieces
+ *	into a ring of NQBUF buffers, while the main thread puts the pieces
+ *	it already has onto the device. In ascii mode the reader also works
+ *	out the size with '\r's put in, so replace() needn't read it twice.
+ *	The pieces of each file are in order, the first one carrying what
+ *	stat() said, and the last one saying so.
  */
-dir *
-getdir(start)
+#ifndef	NOTHREAD
+#define	NQBUF	4
+
+struct	qbuf
 {
-	dir	*sub;
-	int	count, clus;
+	int	err;		/* errno, if stat(), open() or read() failed */
+	int	last;		/* Last piece of the file */
+	struct	stat	sb;	/* First piece of a file */
+	long	asize;		/* Ditto, in ascii mode */
+	long	len;		/* Bytes in data, -1 for a read error */
+	long	off;		/* Bytes replace() has taken */
+	char	*data;
+}	qring[NQBUF];
+char	**qfiles;		/* The files, for the reader */
+int	qnfiles;
+long	qin, qout;		/* Pieces filled and emptied */
+long	qbsize;			/* Size of each */
+pthread_mutex_t	qlock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t	qmoved = PTHREAD_COND_INITIALIZER;
 
-	/*
-	 *	Read the directory first to find out how big it is
-	 */
-	count = 1;
-	clus = start;
-	while ((clus = getfat(clus)) < 0xFF7 && clus)
-		count++;
-	/* Allocate memory */
-printf("Dir is %d clusters starting at %d\n", count, start);
-	/* Enough for one extra entry is allocated */
-	sub = (dir *)Malloc(count*CLUSIZE + sizeof(dir));
-	sub[count*DPCLUS].name[0] = 0;
+/*
+ *	Replace each file named, reading ahead in another thread
+ */
+void
+qforall()
+{
+	pthread_t	reader;
+	int	i;
 
-	clus = start;
-	count = 0;		/* Count clusters */
-	do if (!readclus(clus,sub + count*CLUSIZE))
+	qbsize = hostbuf < CLUSIZE ? CLUSIZE : hostbuf;
+	for (i = 0; i < NQBUF; i++)
+		qring[i].data = Malloc(qbsize);
+	qin = qout = 0;
+	qfiles = files;
+	qnfiles = nfiles;
+	if (pthread_create(&reader,NULL,qreader,NULL) != 0)
 	{
-		fprintf(stderr,"Directory read error may cause headaches\n");
-		/* Use whatever we can of the directory */
-		break;
+		forall(replace);	/* Never mind */
+		return;
 	}
-	else
-		count++;
-	while ((clus = getfat(clus)) < 0xFF7 && clus);
-
-	/* hex_dump(sub, count*CLUSIZE); */
-
-	fixdir(sub,getdir_num = count*CLUSIZE/sizeof(dir));
-	return sub;
+	for (qon = 1; nfiles > 0; nfiles--)
+	{
+		replace(*files++);
+		qdone();
+	}
+	qon = 0;
+	pthread_join(reader,NULL);
+	for (i = 0; i < NQBUF; i++)
+		free(qring[i].data);
 }
 
 /*
- *	Rewrite the directory
- *	This compresses the directory first, freeing space if possible.
- *	Note: in a "replace", the directory may have grown by one entry.
- *	We will need to allocate another cluster if it overflows.
+ *	The reader thread: fill the ring from the files
  */
-void
-putdir(start,dp,num)
-dir	*dp;
+void *
+qreader(arg)
+void	*arg;
 {
-	register i, realnum, count;
-	register dir	*dfrom, *dto;
-	register next, last;
+	register struct	qbuf	*qp;
+	int	i, fd;
+	char	*name;
 
-	/*
-	 *	Crush out deleted entries
-	 */
-	for (dfrom = dto = dp, i = 0; i < num; i++, dfrom++)
+	for (i = 0; i < qnfiles; i++)
 	{
-		if (dfrom->name[0] == 0)
-			break;	/* Never used */
-		if (dfrom->name[0] == (char)0xE5)
+		name = qfiles[i];
+		qp = qfree();
+		qp->err = 0;
+		qp->last = 1;
+		qp->asize = qp->len = qp->off = 0;
+		fd = -1;
+		if (access(name,04) != 0 || stat(name,&qp->sb) != 0)
+			qp->err = errno;
+		else if ((qp->sb.st_mode&S_IFMT) != S_IFDIR)
 		{
-			dfrom->name[0] = 0;
-			continue;
+			if ((fd = open(name,0)) < 0)
+				qp->err = errno;
+			else
+			{
+#ifdef	POSIX_FADV_SEQUENTIAL
+				posix_fadvise(fd,0L,0L,POSIX_FADV_SEQUENTIAL);
+#endif
+				if (!binary && ((qp->asize = asize(fd,qp->data,qbsize)) < 0
+				 || lseek(fd,0L,0) < 0))
+					qp->asize = qp->sb.st_size;	/* Let it fail below */
+				qp->last = 0;
+			}
 		}
-		if (dfrom != dto)
+		while (!qp->last)
 		{
-			*dto = *dfrom;
-			dfrom->name[0] = 0;
+			if ((qp->len = hostread(fd,qp->data,qbsize)) < qbsize)
+				qp->last = 1;
+			if (qp->len < 0)
+				qp->err = errno;
+			qfull();
+			if (qp->last)
+				break;
+			qp = qfree();
+			qp->err = qp->last = 0;
+			qp->off = 0;
 		}
-		dto++;
+		if (fd < 0)
+			qfull();	/* Just the stat() */
+		else
+			close(fd);
 	}
+	return NULL;
+}
 
-	if (dp == rootdir)
-	{		/* Just say root dir must be written */
-		root_mod = 1;
-		return;
-	}
+/*
+ *	Wait for an empty buffer in the ring
+ */
+struct qbuf *
+qfree()
+{
+	pthread_mutex_lock(&qlock);
+	while (qin - qout == NQBUF)
+		pthread_cond_wait(&qmoved,&qlock);
+	pthread_mutex_unlock(&qlock);
+	return &qring[qin%NQBUF];
+}
 
-	realnum = dto-dp;
-	fixdir(dp,num);
-	next = start;
-	for (count = 0; count < realnum; count += DPCLUS)
-	{
-		if (next <= 0 || next >= 0xFF7)
-		{		/* No cluster allocated - dir grew */
-			last = next;
-			next = getfree();
-			if (last == 0)
-			{		/* Can't happen ... */
-				/* dir had no clusters */
-				start = next;
-			}
-			else
-				putfat(last,next);
-			putfat(next,0xFF8);
+/*
+ *	Hand over the buffer just filled
+ */
+void
+qfull()
+{
+	pthread_mutex_lock(&qlock);
+	qin++;
+	pthread_cond_broadcast(&qmoved);
+	pthread_mutex_unlock(&qlock);
+}
+
+/*
+ *	Wait for the next piece to be filled
+ */
+struct qbuf *
+qnext()
+{
+	pthread_mutex_lock(&qlock);
+	while (qout == qin)
+		pthread_cond_wait(&qmoved,&qlock);
+	pthread_mutex_unlock(&qlock);
+	return &qring[qout%NQBUF];
+}
+
+/*
+ *	Give back the piece replace() is done with
+ */
+void
+qempty()
+{
+	pthread_mutex_lock(&qlock);
+	qout++;
+	pthread_cond_broadcast(&qmoved);
+	pthread_mutex_unlock(&qlock);
+}
+
+/*
+ *	What stat() said about the file replace() is starting on.
+ *	Returns -1, with errno set, if it can't be read.
+ */
+qstat(sbp)
+struct	stat	*sbp;
+{
+	register struct	qbuf	*qp = qnext();
+
+	*sbp = qp->sb;
+	qasize = qp->asize;
+	if (qp->err && qp->len == 0)
+	{
+		errno = qp->err;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ *	Take up to n bytes of the file from the ring.
+ *	The last piece is left for qdone().
+ */
+long
+qread(buf,n)
+char	*buf;
+long	n;
+{
+	register struct	qbuf	*qp;
+	long	got = 0, c;
+
+	while (got < n)
+	{
+		qp = qnext();
+		if (qp->len < 0)
+		{
+			errno = qp->err;
+			return got ? got : -1;
 		}
-		if (!writeclus(next,(char *)(dp+count)))
+		c = qp->len - qp->off;
+		if (c > n-got)
+			c = n-got;
+		memcpy(buf+got,qp->data+qp->off,c);
+		qp->off += c;
+		got += c;
+		if (qp->off == qp->len)
 		{
-			fprintf(stderr,"Directory write error - scrambled eggs !\n");
-			break;
+			if (qp->last)
+				break;
+			qempty();
 		}
-		last = next;
-		next = getfat(next);
 	}
-	if (next >= 2 && next < 0xFF7)
-	{		/* directory got shorter */
-		putfat(last,0xFF8);
-		truncate(next);	/* Free remaining blocks */
+	return got;
+}
+
+/*
+ *	Skip whatever replace() didn't take of its file
+ */
+void
+qdone()
+{
+	int	last;
+
+	do
+	{
+		last = qnext()->last;
+		qempty();	/* The reader may have it now */
 	}
+	while (!last);
+}
+#else
+void
+qforall()
+{
+	forall(replace);
+}
+
+long
+qread(buf,n)
+char	*buf;
+long	n;
+{
+	return -1;
+}
+
+qstat(sbp)
+struct	stat	*sbp;
+{
+	return -1;
 }
+#endif
 
 /*
- *	Do all the byte swapping etc for a directory so we can look at it.
- *	NOTE:	This process works both ways.
+ *	Copy len bytes from device address addr to the current position
+ *	of fd inside the kernel, sharing blocks where the filesystem can.
+ *	Return 0 if it couldn't all be done.
  */
-dir *
-fixdir(dp,num)
-dir	*dp;
+kcopy(fd,addr,len)
+long	addr, len;
 {
-	char	*from, *to;
-	short	tmp;
-	register i;
-	dir	*vol = NULL;
+#ifndef	NOKCOPY
+	static	int	nocfr = 0;	/* copy_file_range() unavailable */
+	long	n;
+	loff_t	off = addr;		/* Not a long everywhere */
+	off_t	soff;
 
-	for (i = 0; i < num; i++, dp++)
+	while (len > 0)
 	{
-		if (dp->name[0] == 0)
+		n = -1;
+		if (!nocfr)
+		{
+			n = copy_file_range(disk,&off,fd,(loff_t *)0,
+				(size_t)len,0);
+			if (n < 0 && errno == ENOSYS)
+				nocfr = 1;
+		}
+		if (n < 0)
+		{
+			soff = off;
+			n = sendfile(fd,disk,&soff,(size_t)len);
+			off = soff;
+		}
+		if (n <= 0)
+			return 0;
+		len -= n;
+	}
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+/*
+ *	Return 1 if the n bytes at p are all zero.
+ *	Comparing the buffer with itself shifted by one byte
+ *	lets the library's (vectorized) memcmp do the scanning.
+ */
+iszero(p,n)
+char	*p;
+{
+	if (n <= 0)
+		return 1;
+	return p[0] == 0 && memcmp(p,p+1,n-1) == 0;
+}
+
+makefile(name,mode)
+char	*name;
+{
+	register of;
+
+	if (makepath(name,0) < 0)
+		return -1;
+	of = creat(name,mode);
+	if (of < 0)
+		perror(name);
+	return of;
+}
+
+/*
+ *	Make any UNIX directories leading to name that don't exist,
+ *	and name itself too if whole is set.
+ */
+makepath(name,whole)
+char	*name;
+{
+	register char	*p = name;
+	struct	stat	stbuf;
+	char	*strchr();
+
+	for (;;) {
+		p = strchr(p,'/');
+		if (p == NULL && !whole)
+			return 0;
+		if (p != NULL)
+			*p = '\0';
+		if (stat(name,&stbuf) < 0)	/* dir doesn't exist */
+		{
+			if (mkdir(name, 0777))
+			{
+				fprintf(stderr, "Unable to make directory %s\n",
+					name);
+				break;
+			}
+		}
+		else if ((stbuf.st_mode&S_IFMT) != S_IFDIR) {
+			fprintf(stderr,"File in path: %s\n",name);
 			break;
-		if (dp->name[0] == (char)0xE5)
-			continue;
-#ifndef	NOSWAB
-		/*
-		 *	Do byte swapping for numeric data
-		 */
-		from = (char *)&dp->SWABFROM;
-		to = (char *)&dp->SWABTO+sizeof(dp->SWABTO);
-		myswab(from, to-from);
+		}
+		if (p == NULL)
+			return 0;
+		*p++ = '/';
+	}
+	if (p != NULL)
+		*p = '/';
+	return -1;
+}
+
+/*
+mkdir(n, mode)
+char	*n;
+{
+	char	buf[120];
 
-		tmp = dp->s.ssize[0];
-		dp->s.ssize[0] = dp->s.ssize[1];
-		dp->s.ssize[1] = tmp;
-#endif // NOSWAB
+	strcpy(buf,"mkdir ");
+	strcat(buf,n);
+	return system(buf);
+}
+*/
 
-		if (dp->attr&VOLUME)
-			vol = dp;
+/*
+ *	Deleting is planned first and done by delflush(): each entry is
+ *	marked deleted in the one copy kept of its directory, and the first
+ *	cluster of its chain is noted. Then the FAT is swept once to free
+ *	all the chains, and each directory is written once.
+ */
+struct	dgroup
+{
+	int	start;		/* First cluster of the directory, 0 for root */
+	dir	*dirp;
+	int	num;
+}	*dgroups;
+int	ndgroups;
+char	*dchains;		/* Clusters to free, 1 at the start of a chain */
+
+/*
+ *	Plan to delete a file or directory
+ */
+void
+delete(f)
+char	*f;
+{
+	pinit(f);
+	deltree(recurse);
+}
+
+/*
+ *	Plan to delete what's named in pathbuf. A directory has to be empty
+ *	unless all, in which case everything in it goes too.
+ */
+void
+deltree(all)
+{
+	dir	*dirp, *dp, *sub;
+	int	num, start, i;
+	register struct	dgroup	*gp;
+
+	if ((dp = lookup(pathbuf,&dirp,&num,&start)) == NULL)
+	{
+		printf("%s doesn't exist\n",pathbuf);
+		nerrors++;
+		return;
+	}
+
+	/*
+	 *	Use the copy of the directory we have, if there is one
+	 */
+	i = dp - dirp;
+	for (gp = dgroups; gp < dgroups+ndgroups; gp++)
+		if (gp->start == start)
+			break;
+	if (gp < dgroups+ndgroups)
+	{
+		if (dirp != rootdir)
+			free(dirp);
+	}
+	else
+	{
+		if ((ndgroups&15) == 0)
+			dgroups = (struct dgroup *)(dgroups
+			    ? realloc(dgroups,(ndgroups+16)*sizeof(struct dgroup))
+			    : Malloc(16*sizeof(struct dgroup)));
+		if (dgroups == NULL)
+			erexit("Help! Out of memory... aborting\n", 0);
+		gp = &dgroups[ndgroups++];
+		gp->start = start;
+		gp->dirp = dirp;
+		gp->num = num;
+	}
+	dp = gp->dirp+i;
+	if (dp->name[0] == (char)0xE5)
+		return;			/* Named twice */
+
+	if (dp->attr&DIRECT)
+	{
+		/* Its own deletes so far are only in its group's copy */
+		for (gp = dgroups; gp < dgroups+ndgroups; gp++)
+			if (gp->start == dstart(dp))
+				break;
+		if (gp < dgroups+ndgroups)
+		{
+			sub = gp->dirp;
+			num = gp->num;
+		}
+		else
+		{
+			sub = getdir(dstart(dp));
+			num = getdir_num;
+		}
+		for (i = 0; i < num && sub[i].name[0] != 0; i++)
+			if (sub[i].name[0] != '.' && sub[i].name[0] != (char)0xE5)
+				break;
+		if (i < num && sub[i].name[0] != 0)
+		{
+			if (!all)
+			{
+				printf("%s: Directory not empty\n",pathbuf);
+				if (gp == dgroups+ndgroups)
+					free(sub);
+				return;
+			}
+			delwalk(sub,num);
+		}
+		if (gp == dgroups+ndgroups)
+			free(sub);
 	}
-	return vol;
+	show('d',pathbuf);
+	delchain(dstart(dp));
+	dp->name[0] = 0xE5;
 }
 
 /*
- *	Free the chain of clusters beginning with "start"
+ *	Plan to delete everything in a directory that's going
  */
 void
-truncate(start)
+delwalk(dirp,num)
+dir	*dirp;
 {
-	register next;
+	register dir	*dp;
+	dir	*sub;
+	int	old;
 
-	while (start > 0 && start < 0xFF7)
+	for (dp = dirp; dp < dirp+num && dp->name[0] != 0; dp++)
 	{
-		next = getfat(start);
-		putfat(start,0);
-		start = next;
+		if (dp->name[0] == (char)0xE5 || dp->name[0] == '.')
+			continue;
+		old = ppush(fixname(dp->name));
+		if (dp->attr&DIRECT)
+		{
+			sub = getdir(dstart(dp));
+			delwalk(sub,getdir_num);
+			free(sub);
+		}
+		show('d',pathbuf);
+		delchain(dstart(dp));
+		ppop(old);
 	}
 }
 
 /*
- *	Unpack the i'th entry from the file allocation table.
+ *	Note a chain to be freed
  */
-getfat(i)
+void
+delchain(clus)
 {
-	int	num;
+	if (clus < 2 || clus >= NCLUS)
+		return;
+	if (dchains == NULL)
+	{
+		dchains = Malloc(NCLUS);
+		memset(dchains,0,NCLUS);
+	}
+	dchains[clus] = 1;
+}
 
-	if (i < 2 || i >= NCLUS)
-		return -1;
-	num = i*3/2;
-	if (i&01)
-		return ((fat[num]>>4)&0xF) | ((fat[num+1]<<4)&0xFF0);
-	else
-		return (fat[num]&0xFF) | ((fat[num+1]<<8)&0xF00);
+/*
+ *	Do the deletes planned
+ */
+void
+delflush()
+{
+	register c, n;
+	register struct	dgroup	*gp;
+	int	*link;
+
+	if (dchains)
+	{
+		link = (int *)Malloc(NCLUS*sizeof(int));
+		for (c = 2; c < NCLUS; c++)
+			link[c] = getfat(c);
+		for (c = 2; c < NCLUS; c++)
+			if (dchains[c] == 1)
+				for (n = link[c]; n >= 2 && n < NCLUS && !dchains[n];
+				     n = link[n])
+					dchains[n] = 2;
+		for (c = 2; c < NCLUS; c++)
+			if (dchains[c])
+				putfat(c,0);
+		free(link);
+	}
+	for (gp = dgroups; gp < dgroups+ndgroups; gp++)
+	{
+		/* Not if it's gone itself */
+		if (gp->start == 0 || dchains == NULL || !dchains[gp->start])
+			putdir(gp->start,gp->dirp,gp->num);
+		if (gp->dirp != rootdir)
+			free(gp->dirp);
+	}
+	if (dgroups)
+		free(dgroups);
+	if (dchains)
+		free(dchains);
+	dgroups = NULL;
+	dchains = NULL;
+	ndgroups = 0;
 }
 
 /*
- *	Pack a value into the i'th entry of the fat
+ *	Bring the disk up to date with a UNIX file or directory tree.
+ *	A file is only rewritten if its size or time is different.
+ *	With 'h', a file that looks the same is also compared byte for byte,
+ *	and if only its time is different, just the time is updated.
+ *	(Both copies have to be read to hash them, so comparing is cheaper.)
+ *	In ascii mode sizes can't be compared, so only times are.
  */
 void
-putfat(i,val)
+update(f)
+char	*f;
 {
-	int	num;
+	pinit(f);
+	upwalk();
+}
+
+/*
+ *	Update the file or directory named in pathbuf
+ */
+void
+upwalk()
+{
+	char	*f;
+	struct	stat	sb;
+	dir	*dirp, *dp;
+	dir	ent;
+	int	num, start;
+	int	same;
+
+	f = pathbuf;	/* Won't move, as there are no more ppush()es */
+	if (stat(f,&sb) != 0)
+	{
+		perror(f);
+		nerrors++;
+		return;
+	}
+	if ((sb.st_mode&S_IFMT) == S_IFDIR)
+	{
+		updir();
+		return;
+	}
+	if ((dp = lookup(f,&dirp,&num,&start)) == NULL)
+	{
+		replace(f);
+		return;
+	}
+	if (dp->attr&DIRECT)
+	{
+		if (dirp != rootdir)
+			free(dirp);
+		printf("%s: Directory in path\n",f);
+		nerrors++;
+		return;
+	}
+
+	makeent(&ent,"",&sb);
+	same = memcmp(ent.time,dp->time,4) == 0;	/* time and date */
+	if (binary && dsize(&ent) != dsize(dp))
+		same = -1;
+	else if (binary && cmpdata)
+	{
+		if (!samedata(f,dp))
+			same = -1;
+		else if (!same)
+		{		/* Just the time to fix */
+			memcpy(dp->time,ent.time,4);
+			show('t',f);
+			putdir(start,dirp,num);
+			same = 1;
+		}
+	}
+	if (dirp != rootdir)
+		free(dirp);
+	if (same <= 0)
+		replace(f);
+}
+
+/*
+ *	Update a directory from the UNIX directory named in pathbuf,
+ *	making it if need be, then prune what's no longer there.
+ */
+void
+updir()
+{
+	DIR	*d;
+	struct	dirent	*de;
+	dir	*dirp, *dp;
+	int	num, start;
+	int	old;
+	char	*names = NULL;	/* MSDOS names of what's in the UNIX dir */
+	int	nnames = 0;
+
+	if ((d = opendir(pathbuf)) == NULL)
+	{
+		perror(pathbuf);
+		return;
+	}
+	if ((dp = lookup(pathbuf,&dirp,&num,&start)) == NULL)
+		replace(pathbuf);
+	else
+	{
+		if (dirp != rootdir)
+			free(dirp);
+		if ((dp->attr&DIRECT) == 0)
+		{
+			printf("%s is not a directory\n",pathbuf);
+			nerrors++;
+			closedir(d);
+			return;
+		}
+	}
+
+	while ((de = readdir(d)) != NULL)
+	{
+		if (de->d_name[0] == '.')
+			continue;	/* No MSDOS name for these */
+		old = ppush(de->d_name);
+		upwalk();
+		ppop(old);
+		if (prune)
+		{
+			if ((nnames&63) == 0)
+				names = names ? realloc(names,(nnames+64)*11)
+					      : Malloc(64*11);
+			if (names == NULL)
+				erexit("Help! Out of memory... aborting\n", 0);
+			dosname(names+nnames*11,de->d_name);
+			nnames++;
+		}
+	}
+	closedir(d);
+
+	if (prune
+	 && (dp = lookup(pathbuf,&dirp,&num,&start)) != NULL
+	 && dp->attr&DIRECT)
+	{
+		char	*gone;	/* MSDOS names of what's to go */
+		int	ngone = 0, i;
+		dir	*sub;
+
+		qsort(names,nnames,11,strncmp11);
+		sub = getdir(dstart(dp));
+		gone = Malloc(getdir_num*11);
+		for (dp = sub; dp < sub+getdir_num && dp->name[0] != 0; dp++)
+		{
+			if (dp->name[0] == (char)0xE5
+			 || dp->name[0] == '.'
+			 || dp->attr&VOLUME)
+				continue;
+			if (bsearch(dp->name,names,nnames,11,strncmp11))
+				continue;
+			memcpy(gone+ngone++*11,dp->name,11);
+		}
+		free(sub);
+		if (dirp != rootdir)
+			free(dirp);
+		for (i = 0; i < ngone; i++)
+		{
+			old = ppush(fixname(gone+i*11));
+			deltree(1);
+			ppop(old);
+		}
+		delflush();
+		free(gone);
+	}
+	else if (prune && dp != NULL && dirp != rootdir)
+		free(dirp);
+	if (names)
+		free(names);
+}
+
+/*
+ *	Compare function for sorting MSDOS names
+ */
+strncmp11(a,b)
+char	*a, *b;
+{
+	return strncmp(a,b,11);
+}
+
+/*
+ *	Return 1 if the UNIX file has the same contents as the MSDOS one
+ */
+samedata(f,dp)
+char	*f;
+dir	*dp;
+{
+	int	fd, r, clus;
+	long	addr;
+	char	*buf, *buf1;
+	int	same = 1;
+
+	if ((fd = open(f,0)) < 0)
+		return 0;
+	buf = Malloc(CLUSIZE);
+	buf1 = Malloc(CLUSIZE);
+	for (
+		clus = dstart(dp), addr = 0;
+		same && addr < dsize(dp);
+		addr += CLUSIZE, clus = getfat(clus)
+	)
+	{
+		r = CLUSIZE;
+		if (addr+CLUSIZE > dsize(dp))
+			r = (int)(dsize(dp)-addr);
+		if (!readclus(clus,buf)
+		 || read(fd,buf1,r) != r
+		 || memcmp(buf,buf1,r) != 0)
+			same = 0;
+	}
+	close(fd);
+	free(buf);
+	free(buf1);
+	return same;
+}
+
+/*
+ *	Find the directory entry for a pathname.
+ *	The directory it's in is left in *dirpp (to be freed if it isn't
+ *	rootdir) with its size and first cluster, ready for putdir().
+ */
+dir *
+lookup(f,dirpp,nump,startp)
+char	*f;
+dir	**dirpp;
+int	*nump, *startp;
+{
+	char	*namepart = f;
+	char	*end;
+	char	want[11];
+	dir	*dirp = rootdir;
+	dir	*dp;
+	int	num = NDIR;
+	int	start = 0;
+
+	for (;;)
+	{
+		end = strchr(namepart,'/');
+		if (end != NULL)
+			*end = '\0';
+		dosname(want,namepart);
+		if (end != NULL)
+			*end = '/';
+		for (dp = dirp; dp < dirp+num && dp->name[0] != 0; dp++)
+			if (strncmp(want,dp->name,11) == 0)
+				break;
+		if (dp == dirp+num || dp->name[0] == 0
+		 || (end != NULL && (dp->attr&DIRECT) == 0))
+		{		/* Not there */
+			if (dirp != rootdir)
+				free(dirp);
+			return NULL;
+		}
+		if (end == NULL)
+		{
+			*dirpp = dirp;
+			*nump = num;
+			*startp = start;
+			return dp;
+		}
+		start = dstart(dp);
+		if (dirp != rootdir)
+			free(dirp);
+		dirp = getdir(start);
+		num = getdir_num;
+		namepart = end+1;
+	}
+}
+
+/*
+ *	Attribute letters for listings.
+ *	The long listing stops at the 0; the machine formats go on.
+ */
+struct
+{
+	char	bit;
+	char	flag;
+}	flags[] =
+{
+	{ DIRECT, 'd' },
+	{ RONLY, 'r' },
+	{ HIDDEN, 'h' },
+	{ SYSTEM, 's' },
+	{ 0,	0 },
+	{ ARCHIVE, 'a' }
+};
+
+/*
+ *	List the entry named in pathbuf in a machine readable format:
+ *	path, attributes, size, time and first cluster, either as tab
+ *	separated fields ending in a newline ('T'), as fields each ended
+ *	by a NUL ('N'), or as a JSON object on a line ('J').
+ *	It's all put together by hand in one big buffer,
+ *	so a large listing costs little more than the write.
+ */
+void
+lentry(dp)
+register dir	*dp;
+{
+	register i;
+	register char	*p;
+	char	attrs[8];
+	char	sep = lformat == 'J' ? ',' : lformat == 'N' ? '\0' : '\t';
+
+	for (i = 0, p = attrs; i < sizeof(flags)/sizeof(flags[0]); i++)
+		if (flags[i].bit && dp->attr&flags[i].bit)
+			*p++ = flags[i].flag;
+	*p = '\0';
+
+	if (lformat == 'J')
+	{
+		oputs("{");
+		if (tag != NULL)
+		{
+			oputs("\"image\":\"");
+			ojson(tag);
+			oputs("\",");
+		}
+		oputs("\"path\":\"");
+		ojson(pathbuf);
+		oputs("\",\"attr\":\"");
+		oputs(attrs);
+		oputs("\",\"size\":");
+	}
+	else
+	{
+		if (tag != NULL)
+		{
+			oputs(tag);
+			oput(&sep,1);
+		}
+		oputs(pathbuf);
+		oput(&sep,1);
+		oputs(attrs);
+		oput(&sep,1);
+	}
+	onum(dsize(dp),0);
+
+	oput(&sep,1);
+	if (lformat == 'J')
+		oputs("\"time\":\"");
+	onum((long)1980+dyear(dp),4);
+	oput("-",1);
+	onum((long)dmonth(dp),2);
+	oput("-",1);
+	onum((long)dday(dp),2);
+	oput("T",1);
+	onum((long)dhour(dp),2);
+	oput(":",1);
+	onum((long)dminute(dp),2);
+	oput(":",1);
+	onum((long)dsecond(dp)*2,2);
+	if (lformat == 'J')
+		oputs("\",\"start\":");
+	else
+		oput(&sep,1);
+	onum((long)dstart(dp),0);
+
+	if (lformat == 'J')
+		oputs("}\n");
+	else
+		oput(lformat == 'N' ? "" : "\n",1);
+}
+
+/*
+ *	A string, with JSON escapes
+ */
+void
+ojson(p)
+register char	*p;
+{
+	for (; *p != '\0'; p++)
+	{
+		if (*p == '"' || *p == '\\')
+			oput("\\",1);
+		if ((*p&0xFF) < ' ' || (*p&0xFF) >= 0x7F)
+		{		/* Code page bytes taken as Latin-1 */
+			oputs("\\u00");
+			oput("0123456789abcdef"+(*p>>4&0xF),1);
+			oput("0123456789abcdef"+(*p&0xF),1);
+		}
+		else
+			oput(p,1);
+	}
+}
+
+/*
+ *	Listing output buffer
+ */
+#define	OBUFSIZ	(64*1024)
+char	*obuf;
+int	olen;
+
+/*
+ *	Add n bytes to the listing output
+ */
+void
+oput(p,n)
+char	*p;
+{
+	if (obuf == NULL)
+	{
+		obuf = Malloc(OBUFSIZ);
+		fflush(stdout);		/* Whatever's been printed goes first */
+	}
+	if (olen+n > OBUFSIZ)
+		oflush();
+	memcpy(obuf+olen,p,n);
+	olen += n;
+}
+
+void
+oputs(s)
+char	*s;
+{
+	oput(s,strlen(s));
+}
+
+/*
+ *	Add a number, with leading zeros to make at least width digits
+ */
+void
+onum(n,width)
+long	n;
+{
+	char	buf[24];
+	register char	*p = buf+sizeof(buf);
+
+	if (width > 20)
+		width = 20;
+	do {
+		*--p = '0' + n%10;
+		n /= 10;
+		width--;
+	} while (n > 0 || width > 0);
+	oput(p,buf+sizeof(buf)-p);
+}
+
+void
+oflush()
+{
+	if (olen > 0 && write(1,obuf,olen) != olen)
+		perror("stdout");
+	olen = 0;
+}
+
+/*
+ *	Build the pattern tree from the file arguments
+ */
+void
+pcompile()
+{
+	register struct	pnode	*np, *kid;
+	register char	*p, *end;
+	char	*comp;
+	int	i, k;
+
+	if (nfiles == 0)
+		return;
+	ptree = pnew();
+	for (i = 0; i < nfiles; i++)
+	{
+		np = ptree;
+		for (p = files[i]; *p != '\0'; p = end)
+		{
+			if ((end = strchr(p,'/')) == NULL)
+				end = p+strlen(p);
+			comp = Malloc(end-p+1);
+			strncpy(comp,p,end-p);
+			comp[end-p] = '\0';
+			if (*end == '/')
+				end++;
+			if (*comp == '\0')
+			{
+				free(comp);
+				continue;
+			}
+
+			if (strpbrk(comp,"*?") != NULL)
+			{
+				for (kid = np->wild; kid; kid = kid->next)
+					if (strcmp(kid->pat,comp) == 0)
+						break;
+				if (kid == NULL)
+				{
+					kid = pnew();
+					kid->pat = comp;
+					kid->next = np->wild;
+					np->wild = kid;
+				}
+				else
+					free(comp);
+			}
+			else
+			{
+				char	want[11];
+
+				dosname(want,comp);
+				free(comp);
+				for (k = 0; k < np->nkids; k++)
+					if (strncmp(np->kids[k]->name,want,11) == 0)
+						break;
+				if (k < np->nkids)
+					kid = np->kids[k];
+				else
+				{
+					kid = pnew();
+					strncpy(kid->name,want,11);
+					if ((np->nkids&7) == 0)
+						np->kids = (struct pnode **)(np->kids
+						    ? realloc(np->kids,(np->nkids+8)*sizeof(kid))
+						    : Malloc(8*sizeof(kid)));
+					if (np->kids == NULL)
+						erexit("Help! Out of memory... aborting\n", 0);
+					np->kids[np->nkids++] = kid;
+				}
+			}
+			np = kid;
+		}
+		np->leaf = 1;
+	}
+	psort(ptree);
+}
+
+/*
+ *	A new, empty, pattern node
+ */
+struct	pnode *
+pnew()
+{
+	register struct	pnode	*np;
+
+	np = (struct pnode *)Malloc(sizeof(struct pnode));
+	memset(np,0,sizeof(struct pnode));
+	npnodes++;
+	return np;
+}
+
+/*
+ *	Sort the plain children of every node
+ */
+void
+psort(np)
+register struct	pnode	*np;
+{
+	register i;
+
+	qsort(np->kids,np->nkids,sizeof(*np->kids),pnodecmp);
+	for (i = 0; i < np->nkids; i++)
+		psort(np->kids[i]);
+	for (np = np->wild; np; np = np->next)
+		psort(np);
+}
+
+/*
+ *	Free a pattern tree
+ */
+void
+pfree(np)
+register struct	pnode	*np;
+{
+	register struct	pnode	*w, *next;
+	register i;
+
+	if (np == NULL)
+		return;
+	for (i = 0; i < np->nkids; i++)
+		pfree(np->kids[i]);
+	for (w = np->wild; w; w = next)
+	{
+		next = w->next;
+		pfree(w);
+	}
+	if (np->kids)
+		free(np->kids);
+	if (np->pat)
+		free(np->pat);
+	free(np);
+	npnodes--;
+}
+
+pnodecmp(a,b)
+struct	pnode	**a, **b;
+{
+	return strncmp((*a)->name,(*b)->name,11);
+}
+
+/*
+ *	Match a directory entry against the set of nodes that matched its
+ *	directory. The nodes that match it go into next[] (*nnext of them).
+ *	Return 2 if a whole file argument matches it (or set is NULL,
+ *	meaning everything matches), 1 if just the start of one does,
+ *	and 0 if none does.
+ */
+pmatch(set,nset,dp,next,nnext)
+struct	pnode	**set;
+dir	*dp;
+struct	pnode	**next;
+int	*nnext;
+{
+	register struct	pnode	*np, *kid;
+	register lo, hi, mid, c;
+	int	ret = 0;
+	char	*name = NULL;
+
+	*nnext = 0;
+	if (set == NULL)
+		return 2;
+	while (nset-- > 0)
+	{
+		np = *set++;
+		for (lo = 0, hi = np->nkids; lo < hi;)
+		{
+			mid = (lo+hi)/2;
+			kid = np->kids[mid];
+			if ((c = strncmp(dp->name,kid->name,11)) == 0)
+			{
+				next[(*nnext)++] = kid;
+				ret = kid->leaf ? 2 : ret ? ret : 1;
+				break;
+			}
+			if (c < 0)
+				hi = mid;
+			else
+				lo = mid+1;
+		}
+		for (kid = np->wild; kid; kid = kid->next)
+		{
+			if (name == NULL)
+				name = fixname(dp->name);
+			if (wmatch(kid->pat,name))
+			{
+				next[(*nnext)++] = kid;
+				ret = kid->leaf ? 2 : ret ? ret : 1;
+			}
+		}
+	}
+	return ret;
+}
+
+/*
+ *	Shell style wildcard match of a name, ignoring case
+ */
+wmatch(pat,name)
+register char	*pat, *name;
+{
+	for (; *pat != '\0'; pat++, name++)
+	{
+		if (*pat == '*')
+		{
+			while (*++pat == '*')
+				;
+			if (*pat == '\0')
+				return 1;
+			for (; *name != '\0'; name++)
+				if (wmatch(pat,name))
+					return 1;
+			return 0;
+		}
+		if (*name == '\0')
+			return 0;
+		if (*pat != '?' && lcase(*pat) != lcase(*name))
+			return 0;
+	}
+	return *name == '\0';
+}
+
+/*
+ *	Given the actual contents of a directory
+ *	whose pathname is in pathbuf, list out either:
+ *		the contents of the directory and it's subdirectories
+ *		The named files and/or directories
+ *	set is the nset pattern nodes that matched the directory,
+ *	or NULL if everything in it is to be listed.
+ */
+void
+listdir(direct,num,set,nset)
+dir	*direct;
+struct	pnode	**set;
+{
+	register i, j;
+	register dir	*dp = direct;
+	register dir	*sub;
+	int	old;
+	struct	pnode	**next = NULL;
+	int	nnext;
+
+	if (set != NULL)
+		next = (struct pnode **)Malloc(npnodes*sizeof(*next));
+	for (j = 0; j < num; j++, dp++)
+	{
+		if (dp->name[0] == 0)
+			break;
+		if (dp->name[0] == (char)0xE5)
+			continue;
+		if (dp->attr&VOLUME)
+			continue;
+		if (pmatch(set,nset,dp,next,&nnext) != 2)
+			continue;
+		/* Don't show directory if we'll show contents */
+		if (nfiles && dp->attr&DIRECT)
+			continue;
+		/*
+		 *	Don't list . and ..
+		 */
+		if (dp->name[0] == '.')
+			continue;
+
+		if (lformat)
+		{
+			old = ppush(fixname(dp->name));
+			lentry(dp);
+			ppop(old);
+			continue;
+		}
+		if (verbose)
+		{
+			for (i = 0; flags[i].bit; i++)
+				if (dp->attr & flags[i].bit)
+					putchar(flags[i].flag);
+				else
+					putchar('-');
+
+			printf(" %02d:%02d:%02d %02d/%02d/%02d ",
+				dhour(dp),dminute(dp),dsecond(dp)*2,
+				dday(dp),dmonth(dp),1980+dyear(dp));
+
+			if (dp->attr&DIRECT)
+				printf("        ");
+			else
+				printf("%8ld ",dsize(dp));
+		}
+
+		if (verbose)
+			printf("%s\n",fixname(dp->name));
+		else
+		{
+			old = ppush(fixname(dp->name));
+			printf("%s\n",pathbuf);
+			ppop(old);
+		}
+	}
+	/*
+	 *	List out subdirectories
+	 */
+	for (dp = direct, j = 0; j < num; j++, dp++)
+	{
+		if (dp->name[0] == 0)
+			break;
+		if (dp->name[0] == (char)0xE5)
+			continue;
+		if ((dp->attr&DIRECT) == 0)
+			continue;
+		/* Don't go recursive on . and .. ! */
+		if (dp->name[0] == '.')
+			continue;
+		i = pmatch(set,nset,dp,next,&nnext);
+		if (i == 0)
+			continue;
+		old = ppush(fixname(dp->name));
+		if (verbose && !lformat)
+			printf("\n%s:\n",pathbuf);
+		sub = getdir(dstart(dp));
+		listdir(sub,getdir_num,i == 2 ? NULL : next,nnext);
+		free(sub);
+		ppop(old);
+	}
+	if (next)
+		free(next);
+}
+
+/*
+ *	Given the starting cluster of a directory,
+ *	read the directory into Malloc'ed space and return it,
+ *	setting getdir_num to the maximum number of entries.
+ *	After the entries is room for one more, then a copy of the
+ *	clusters as read, so putdir() can tell which have changed.
+ */
+dir *
+getdir(start)
+{
+	dir	*sub;
+	int	count, clus;
+
+	/*
+	 *	Read the directory first to find out how big it is
+	 */
+	count = 1;
+	clus = start;
+	while ((clus = getfat(clus)) < 0xFF7 && clus)
+		count++;
+	/* Allocate memory */
+	/* Enough for one extra entry is allocated, and the copy */
+	sub = (dir *)Malloc(2*count*CLUSIZE + sizeof(dir));
+
+	clus = start;
+	count = 0;		/* Count clusters */
+	do if (!readclus(clus,(char *)sub + count*CLUSIZE))
+	{
+		fprintf(stderr,"Directory read error may cause headaches\n");
+		/* Use whatever we can of the directory */
+		break;
+	}
+	else
+		count++;
+	while ((clus = getfat(clus)) < 0xFF7 && clus);
+
+	/* hex_dump(sub, count*CLUSIZE); */
+
+	getdir_num = count*CLUSIZE/sizeof(dir);
+	sub[getdir_num].name[0] = 0;
+	memcpy((char *)(sub+getdir_num+1),(char *)sub,count*CLUSIZE);
+	return sub;
+}
+
+/*
+ *	Rewrite the directory, from getdir() or rootdir.
+ *	Only the clusters that differ from the copy getdir() kept are
+ *	written. Deleted entries are left for replace() to use again,
+ *	and only crushed out when that would free a cluster.
+ *	Note: in a "replace", the directory may have grown by one entry.
+ *	We will need to allocate another cluster if it overflows.
+ */
+void
+putdir(start,dp,num)
+dir	*dp;
+{
+	register i, realnum, count;
+	register dir	*dfrom, *dto;
+	register next, last;
+	int	nclus = num/DPCLUS;	/* Clusters getdir() read */
+	char	*orig = (char *)(dp+nclus*DPCLUS+1);
+	char	*grown = NULL;
+	int	live;
+
+	if (dp == rootdir)
+	{		/* Just say root dir must be written */
+		root_mod = 1;
+		return;
+	}
+
+	for (i = live = 0; i < num && dp[i].name[0] != 0; i++)
+		if (dp[i].name[0] != (char)0xE5)
+			live++;
+	realnum = i;
+	if ((live+DPCLUS-1)/DPCLUS < (realnum+DPCLUS-1)/DPCLUS)
+	{
+		/*
+		 *	Crush out deleted entries
+		 */
+		for (dfrom = dto = dp; dfrom < dp+realnum; dfrom++)
+		{
+			if (dfrom->name[0] == (char)0xE5)
+			{
+				dfrom->name[0] = 0;
+				continue;
+			}
+			if (dfrom != dto)
+			{
+				*dto = *dfrom;
+				dfrom->name[0] = 0;
+			}
+			dto++;
+		}
+		realnum = live;
+	}
+
+	next = start;
+	for (count = 0; count < realnum; count += DPCLUS)
+	{
+		if (next <= 0 || next >= 0xFF7)
+		{		/* No cluster allocated - dir grew */
+			next = getfree();
+			if (count == 0)
+			{		/* Can't happen ... */
+				/* dir had no clusters */
+				start = next;
+			}
+			else
+				putfat(last,next);
+			putfat(next,0xFF8);
+		}
+		i = count/DPCLUS;
+		if (i >= nclus)
+		{		/* Just the entry that's grown into it */
+			if (grown == NULL)
+				grown = Malloc(CLUSIZE);
+			memset(grown,0,CLUSIZE);
+			memcpy(grown,(char *)(dp+count),
+				(num-count)*sizeof(dir));
+			if (!writeclus(next,grown))
+				goto bad;
+		}
+		else if (memcmp((char *)(dp+count),orig+(long)i*CLUSIZE,CLUSIZE))
+		{
+			if (!writeclus(next,(char *)(dp+count)))
+			{
+			bad:	fprintf(stderr,"Directory write error - scrambled eggs !\n");
+				break;
+			}
+			memcpy(orig+(long)i*CLUSIZE,(char *)(dp+count),CLUSIZE);
+		}
+		last = next;
+		next = getfat(next);
+	}
+	if (grown)
+		free(grown);
+	if (next >= 2 && next < 0xFF7)
+	{		/* directory got shorter */
+		putfat(last,0xFF8);
+		truncate(next);	/* Free remaining blocks */
+	}
+}
+
+/*
+ *	Find the volume label in a directory
+ */
+dir *
+findvol(dp,num)
+register dir	*dp;
+{
+	register dir	*end = dp+num;
+
+	for (; dp < end && dp->name[0] != 0; dp++)
+		if (dp->name[0] != (char)0xE5 && dp->attr&VOLUME)
+			return dp;
+	return NULL;
+}
+
+/*
+ *	Free the chain of clusters beginning with "start"
+ */
+void
+truncate(start)
+{
+	register next;
+
+	while (start > 0 && start < 0xFF7)
+	{
+		next = getfat(start);
+		putfat(start,0);
+		start = next;
+	}
+}
+
+/*
+ *	Unpack the i'th entry from the file allocation table.
+ */
+getfat(i)
+{
+	int	num, lo, hi;
+
+	if (i < 2 || i >= NCLUS)
+		return -1;
+	num = i*3/2;
+	if (fc)
+	{
+		lo = *fatp(num,0);
+		hi = *fatp(num+1,0);
+	}
+	else
+	{
+		lo = fat[num];
+		hi = fat[num+1];
+	}
+	if (i&01)
+		return ((lo>>4)&0xF) | ((hi<<4)&0xFF0);
+	else
+		return (lo&0xFF) | ((hi<<8)&0xF00);
+}
+
+/*
+ *	Pack a value into the i'th entry of the fat
+ */
+void
+putfat(i,val)
+{
+	int	num;
+	char	*lo, *hi;
+
+	if (i < 2 || i >= NCLUS)
+		return;
+	num = i*3/2;
+	if (fc)
+	{
+		lo = fatp(num,1);
+		hi = fatp(num+1,1);
+	}
+	else
+	{
+		lo = &fat[num];
+		hi = &fat[num+1];
+	}
+	if (i&01)
+	{
+		*lo = (*lo&0xF) | ((val<<4)&0xF0);
+		*hi = (val>>4)&0xFF;
+	}
+	else
+	{
+		*lo = val&0xFF;
+		*hi = (*hi&0xF0) | ((val>>8)&0xF);
+	}
+	fat_mod = 1;
+}
+
+/*
+ *	Start a paged FAT
+ */
+void
+fcinit()
+{
+	register i;
+	int	nsec = FATSIZE/SECSIZE;
+
+	fc = (struct fatcache *)Malloc(sizeof(struct fatcache));
+	fc->npages = fatpages < nsec ? fatpages : nsec;
+	fc->pages = (struct fatpage *)Malloc(fc->npages*sizeof(struct fatpage));
+	for (i = 0; i < fc->npages; i++)
+	{
+		fc->pages[i].sec = -1;
+		fc->pages[i].dirty = 0;
+		fc->pages[i].used = 0;
+		fc->pages[i].data = Malloc(SECSIZE);
+	}
+	fc->slot = (int *)Malloc(nsec*sizeof(int));
+	for (i = 0; i < nsec; i++)
+		fc->slot[i] = -1;
+	fc->clock = 0;
+}
+
+/*
+ *	Where byte n of the FAT is, reading in its sector if need be.
+ *	If it's to be changed, say so with dirty.
+ */
+char *
+fatp(n,dirty)
+{
+	register struct	fatpage	*pp, *lru;
+	register s;
+	int	sec = n/SECSIZE, fatno;
+
+	if ((s = fc->slot[sec]) < 0)
+	{
+		for (lru = pp = fc->pages; pp < fc->pages+fc->npages; pp++)
+			if (pp->used < lru->used)
+				lru = pp;
+		pp = lru;
+		if (pp->sec >= 0)
+		{
+			if (pp->dirty)
+				fatwrite(pp);
+			fc->slot[pp->sec] = -1;
+		}
+		pp->sec = sec;
+		for (fatno = 0; fatno < NFAT; fatno++)
+			if (dread((long)FAT1 + (long)fatno*FATSIZE
+			    + (long)sec*SECSIZE,pp->data,SECSIZE) == SECSIZE)
+				break;	/* Try the next copy if read error */
+		if (fatno == NFAT)
+		{
+			fprintf(stderr,"Read error on FAT sector %d\n",sec);
+			memset(pp->data,0,SECSIZE);
+		}
+		fc->slot[sec] = s = pp - fc->pages;
+	}
+	pp = &fc->pages[s];
+	pp->used = ++fc->clock;
+	if (dirty)
+		pp->dirty = 1;
+	return pp->data + n%SECSIZE;
+}
+
+/*
+ *	Write a FAT page to every copy of the FAT
+ */
+void
+fatwrite(pp)
+register struct	fatpage	*pp;
+{
+	int	fatno;
+
+	for (fatno = 0; fatno < NFAT; fatno++)
+		if (dwrite((long)FAT1 + (long)fatno*FATSIZE + (long)pp->sec*SECSIZE,
+		    pp->data,(long)SECSIZE) != SECSIZE)
+			printf("Write error on FAT copy %d ignored\n",fatno);
+	pp->dirty = 0;
+}
+
+/*
+ *	Find a free cluster
+ */
+getfree()
+{
+	int	i;
+
+	for (i = 2; i < NCLUS; i++)
+		if (getfat(i) == 0)
+			return i;
+	return 0;	/* None free */
+}
+
+/*
+ *	Return free space on disk in bytes
+ */
+long
+diskfree()
+{
+	long	space = 0;
+	int	i;
+
+	for (i = 2; i < NCLUS; i++)
+		if (getfat(i) == 0)
+			space++;
+	return space*CLUSIZE;
+}
+
+/*
+ *	Defragmenter state
+ */
+int	*newpos;		/* Where each cluster is to go, or 0 */
+int	nextpos;		/* Next cluster to be handed out */
+int	nchains, nfrag;		/* Chains seen, and how many in pieces */
+struct	dfdir			/* Every subdirectory, as read in */
+{
+	int	start;
+	dir	*dp;
+	int	num;
+}	*dfdirs;
+int	ndfdirs;
+
+/*
+ *	Rearrange the data area so that every chain is contiguous.
+ *	The new layout is planned from the FAT and the directory tree:
+ *	each directory is followed by its files, then its subdirectories.
+ *	Then the data area is read in one go, permuted in memory and the
+ *	clusters that moved are written back in runs, and the FAT and the
+ *	start of every directory entry are rewritten to match.
+ *	A FAT12 volume has less than 4096 clusters, so memory is no problem.
+ */
+void
+defrag()
+{
+	register c, p;
+	int	*link;		/* Old FAT, unpacked */
+	int	*from;		/* Which old cluster goes to each new one */
+	int	moves = 0;
+	char	*old, *new;
+	long	area = (long)(NCLUS-2)*CLUSIZE;
+	struct	dfdir	*df;
+	dir	*dp;
+	int	i, n;
+
+	newpos = (int *)Malloc(NCLUS*sizeof(int));
+	link = (int *)Malloc(NCLUS*sizeof(int));
+	from = (int *)Malloc(NCLUS*sizeof(int));
+	for (c = 0; c < NCLUS; c++)
+	{
+		newpos[c] = from[c] = 0;
+		link[c] = getfat(c);
+	}
+	nextpos = 2;
+	nchains = nfrag = ndfdirs = 0;
+	dfdirs = NULL;
+
+	/*
+	 *	Plan: files and directories in tree order,
+	 *	then anything allocated that nobody owns.
+	 */
+	dfwalk(rootdir,NDIR);
+	for (c = 2; c < NCLUS; c++)
+		if (link[c] != 0 && link[c] != 0xFF7 && !newpos[c])
+			dfplace(c);
+	for (c = 2; c < NCLUS; c++)
+		if (newpos[c])
+		{
+			from[newpos[c]] = c;
+			if (newpos[c] != c)
+				moves++;
+		}
+
+	if (dryrun || verbose)
+		printf("%d of %d chains fragmented, %d clusters to move\n",
+			nfrag, nchains, moves);
+	if (dryrun || moves == 0)
+		goto out;
+
+	/*
+	 *	Point every directory entry at the new place
+	 */
+	for (i = 0, df = dfdirs; i <= ndfdirs; i++, df++)
+	{
+		if (i == ndfdirs)
+		{
+			dp = rootdir;
+			n = NDIR;
+		}
+		else
+		{
+			dp = df->dp;
+			n = df->num;
+		}
+		for (; n > 0 && dp->name[0] != 0; n--, dp++)
+			if (dp->name[0] != (char)0xE5
+			 && (c = dstart(dp)) >= 2 && c < NCLUS
+			 && (p = newpos[c]) != 0)
+				setstart(dp,p);
+	}
+	root_mod = 1;
+
+	/*
+	 *	Move the data
+	 */
+	old = Malloc(area);
+	new = Malloc(area);
+	bcflush(1);
+	if ((c = dread(database,old,area)) < 0)
+		erexit("Read error on data area - nothing moved\n", 0);
+	memset(old+c,0,area-c);		/* Image file may be short */
+	for (c = 2; c < NCLUS; c++)
+		if (from[c])
+			memcpy(new+(long)(c-2)*CLUSIZE,
+				old+(long)(from[c]-2)*CLUSIZE,CLUSIZE);
+
+	/* Directories have been fixed up, so put them in instead */
+	for (i = 0, df = dfdirs; i < ndfdirs; i++, df++)
+	{
+		for (
+			n = 0, c = df->start;
+			n*DPCLUS < df->num && c >= 2 && c < NCLUS;
+			n++, c = link[c]
+		)
+		{
+			p = newpos[c];
+			memcpy(new+(long)(p-2)*CLUSIZE,
+				(char *)df->dp+(long)n*CLUSIZE,CLUSIZE);
+			from[p] = -1;	/* Make sure it's written */
+		}
+	}
+
+	/*
+	 *	Write out runs of clusters that changed
+	 */
+	for (c = 2; c < NCLUS; c = p)
+	{
+		for (p = c; p < NCLUS && from[p] && from[p] != p; p++)
+			;
+		if (p == c)
+		{
+			p++;
+			continue;
+		}
+		if (dwrite((long)(c-2)*CLUSIZE + database,
+			new+(long)(c-2)*CLUSIZE,(long)(p-c)*CLUSIZE)
+		  != (long)(p-c)*CLUSIZE)
+			erexit("Write error while moving clusters - scrambled eggs\n", 0);
+	}
+
+	/*
+	 *	And the new FAT
+	 */
+	for (c = 2; c < NCLUS; c++)
+		putfat(c,link[c] == 0xFF7 ? 0xFF7 : 0);
+	for (c = 2; c < NCLUS; c++)
+		if (newpos[c])
+		{
+			p = link[c];
+			if (p >= 2 && p < 0xFF7 && newpos[p])
+				p = newpos[p];
+			putfat(newpos[c],p);
+		}
+	free(old);
+	free(new);
+
+ out:
+	for (i = 0; i < ndfdirs; i++)
+		free(dfdirs[i].dp);
+	if (dfdirs)
+		free(dfdirs);
+	free(newpos);
+	free(link);
+	free(from);
+}
+
+/*
+ *	Plan where the clusters of a directory's files go,
+ *	then do its subdirectories, each one followed by its own contents.
+ */
+void
+dfwalk(dirp,num)
+dir	*dirp;
+{
+	register dir	*dp;
+	register dir	*sub;
+
+	for (dp = dirp; dp < dirp+num && dp->name[0] != 0; dp++)
+		if (dp->name[0] != (char)0xE5
+		 && (dp->attr&(DIRECT|VOLUME)) == 0)
+			dfplace(dstart(dp));
+
+	for (dp = dirp; dp < dirp+num && dp->name[0] != 0; dp++)
+	{
+		if (dp->name[0] == (char)0xE5
+		 || dp->name[0] == '.'
+		 || (dp->attr&DIRECT) == 0
+		 || dstart(dp) < 2 || dstart(dp) >= NCLUS
+		 || newpos[dstart(dp)])
+			continue;	/* Not a (new) subdirectory */
+		dfplace(dstart(dp));
+		sub = getdir(dstart(dp));
+		if ((ndfdirs&15) == 0)
+			dfdirs = (struct dfdir *)(dfdirs
+			    ? realloc(dfdirs,(ndfdirs+16)*sizeof(struct dfdir))
+			    : Malloc(16*sizeof(struct dfdir)));
+		if (dfdirs == NULL)
+			erexit("Help! Out of memory... aborting\n", 0);
+		dfdirs[ndfdirs].start = dstart(dp);
+		dfdirs[ndfdirs].dp = sub;
+		dfdirs[ndfdirs].num = getdir_num;
+		ndfdirs++;
+		dfwalk(sub,getdir_num);
+	}
+}
+
+/*
+ *	Hand out consecutive new places to the chain starting at clus,
+ *	stepping around bad clusters, which can't move.
+ */
+void
+dfplace(clus)
+{
+	register next;
+	int	pieces = 0;
+
+	if (clus < 2 || clus >= NCLUS || newpos[clus])
+		return;
+	nchains++;
+	for (;;)
+	{
+		while (nextpos < NCLUS && getfat(nextpos) == 0xFF7)
+			nextpos++;
+		newpos[clus] = nextpos++;
+		next = getfat(clus);
+		if (next < 2 || next >= 0xFF7 || newpos[next])
+			break;		/* End of chain (or cross link) */
+		if (next != clus+1)
+			pieces++;
+		clus = next;
+	}
+	if (pieces)
+		nfrag++;
+}
+
+/*
+ *	Checker state
+ */
+char	*owned;			/* Bitmap of clusters claimed by some entry */
+int	ckfiles, ckdirs;	/* Files and directories seen */
+#define	OWNED(c)	(owned[(c)>>3] & (1<<((c)&07)))
+#define	OWN(c)		(owned[(c)>>3] |= (1<<((c)&07)))
+
+/*
+ *	Check the volume in one pass over the directory tree,
+ *	marking off each cluster as its owner is found,
+ *	then look for allocated clusters that nobody owns
+ *	and compare the copies of the FAT.
+ *	Each problem is reported and counted in nerrors.
+ */
+void
+check()
+{
+	register c, next;
+	int	lost = 0, heads = 0, used = 0, bad = 0;
+	char	*pointed;	/* Lost clusters that a lost cluster points at */
+	int	errs = nerrors;	/* Not counting earlier failures */
+
+	owned = Malloc(NCLUS/8+1);
+	memset(owned,0,NCLUS/8+1);
+	ckfiles = ckdirs = 0;
+
+	ppop(0);
+	ckwalk(rootdir,NDIR);
+
+	/*
+	 *	Lost clusters, and the number of chains they make up
+	 */
+	pointed = Malloc(NCLUS/8+1);
+	memset(pointed,0,NCLUS/8+1);
+	for (c = 2; c < NCLUS; c++)
+	{
+		next = getfat(c);
+		if (next == 0)
+			continue;
+		if (next == 0xFF7)
+		{
+			bad++;
+			continue;
+		}
+		used++;
+		if (OWNED(c))
+			continue;
+		lost++;
+		if (next >= 2 && next < NCLUS)
+			pointed[next>>3] |= 1<<(next&07);
+	}
+	for (c = 2; c < NCLUS; c++)
+		if (getfat(c) != 0 && getfat(c) != 0xFF7 && !OWNED(c)
+		 && !(pointed[c>>3] & (1<<(c&07))))
+			heads++;
+	if (lost)
+	{
+		printf("%d lost clusters in %d chains\n",lost,heads ? heads : 1);
+		nerrors++;
+	}
+
+	ckfats();
+
+	if (verbose)
+		printf("%d files, %d directories, %d clusters used, %d free, %d bad\n",
+			ckfiles, ckdirs, used, NCLUS-2-used-bad, bad);
+	if ((errs = nerrors-errs) != 0)
+		printf("%d problem%s found\n",errs,errs == 1 ? "" : "s");
+	free(owned);
+	free(pointed);
+}
+
+/*
+ *	Claim every chain in a directory, and check its subdirectories.
+ */
+void
+ckwalk(dirp,num)
+dir	*dirp;
+{
+	register dir	*dp;
+	register dir	*sub;
+	int	n, old;
+	long	want;
+
+	for (dp = dirp; dp < dirp+num && dp->name[0] != 0; dp++)
+	{
+		if (dp->name[0] == (char)0xE5
+		 || dp->name[0] == '.'
+		 || dp->attr&VOLUME)
+			continue;
+		old = ppush(fixname(dp->name));
+
+		n = ckchain(pathbuf,dstart(dp));
+		if (dp->attr&DIRECT)
+		{
+			ckdirs++;
+			if (n == 0)
+			{
+				printf("%s: directory has no clusters\n",pathbuf);
+				nerrors++;
+			}
+			if (n > 0)
+			{		/* Don't follow a bad chain */
+				sub = getdir(dstart(dp));
+				ckwalk(sub,getdir_num);
+				free(sub);
+			}
+		}
+		else
+		{
+			ckfiles++;
+			want = (dsize(dp)+CLUSIZE-1)/CLUSIZE;
+			if (n >= 0 && n != want)
+			{
+				printf("%s: size %ld needs %ld clusters, chain has %d\n",
+					pathbuf, dsize(dp), want, n);
+				nerrors++;
+			}
+		}
+		ppop(old);
+	}
+}
+
+/*
+ *	Claim the chain starting at clus for the named file.
+ *	Return its length, or -1 after reporting why it is broken.
+ */
+ckchain(name,clus)
+char	*name;
+{
+	register n, next;
+
+	if (clus == 0)
+		return 0;
+	for (n = 1; ; n++)
+	{
+		if (clus < 2 || clus >= NCLUS)
+		{
+			printf("%s: cluster %d out of range\n",name,clus);
+			break;
+		}
+		if (OWNED(clus))
+		{
+			printf("%s: cross-linked at cluster %d\n",name,clus);
+			break;
+		}
+		OWN(clus);
+		next = getfat(clus);
+		if (next >= 0xFF8)
+			return n;
+		if (next == 0)
+		{
+			printf("%s: chain runs into free cluster %d\n",
+				name,clus);
+			break;
+		}
+		if (next == 0xFF7)
+		{
+			printf("%s: chain runs into bad cluster %d\n",
+				name,clus);
+			break;
+		}
+		clus = next;
+	}
+	nerrors++;
+	return -1;
+}
+
+/*
+ *	Compare each copy of the FAT with the one in use.
+ */
+void
+ckfats()
+{
+	register i, diff;
+	int	fatno;
+	char	*copy;
+
+	if (fat_mod)
+		return;		/* Earlier script commands not written yet */
+	copy = Malloc(FATSIZE);
+	for (fatno = 0; fatno < NFAT; fatno++)
+	{
+		if (dread((long)FAT1 + (long)fatno*FATSIZE,copy,FATSIZE)
+		  != FATSIZE)
+		{
+			printf("Read error on FAT copy %d\n",fatno);
+			nerrors++;
+			continue;
+		}
+		for (i = diff = 0; i < FATSIZE; i++)
+			if (copy[i] != (fc ? *fatp(i,0) : fat[i]))
+				diff++;
+		if (diff)
+		{
+			printf("FAT copy %d differs in %d bytes\n",fatno,diff);
+			nerrors++;
+		}
+	}
+	free(copy);
+}
+
+/*
+ *	Read in the file allocation table (fat)
+ *	and the root directory
+ */
+dir *
+getdisk()
+{
+	long	fatno;
+
+	/*
+	 *	Read the boot record.
+	 */
+	readboot();
+
+	rootdir = (dir *)Malloc(sizeof(dir)*NDIR);
+	bcinit();
+	if (fatpages)
+		fcinit();	/* Read as it's wanted */
+	else
+	{
+		fat = Malloc(FATSIZE);
+
+		/* Get fat */
+		for (
+		    fatno = 0;
+		    fatno < NFAT
+		 && dread((long)FAT1 + fatno*FATSIZE,fat,FATSIZE) != FATSIZE;
+						/* Try again if read error */
+		    fatno++
+		)
+			;
+
+		if (cmd != 't' && fatno == NFAT)
+			erexit("Can't read file allocation table\n", 0);
+	}
+
+	/* seek to start of directory */
+	rootaddr = FAT1 + NFAT*FATSIZE;
+	if (dread(rootaddr,rootdir,sizeof(dir)*NDIR) != sizeof(dir)*NDIR)
+		erexit("Read error on root directory\n", 0);
+	database = rootaddr + sizeof(dir)*NDIR;
+	return findvol(rootdir,NDIR);
+}
+
+/*
+ *	Initialize the fat, and the root directory
+ */
+void
+dos_format()
+{
+	register char	*cp;
+	register i;
+	int	rds, fatno;
+	dir	*dp;
+
+	/*
+	 *	Write the boot record.
+	 */
+	writeboot();
+
+	/*
+	 *	Create empty root directory
+	 */
+	rds = sizeof(dir)*NDIR;
+	rootaddr = FAT1+NFAT*FATSIZE;
+	database = rootaddr+rds;
+	rootdir = (dir *)Malloc(rds);
+	cp = (char *)rootdir;
+	while (cp < (char *)rootdir+rds)
+		*cp++ = 0xE5;
+
+	for (dp = rootdir; dp < rootdir+NDIR; dp++)
+		dp->name[0] = 0;
+	root_mod = 1;
+
+	bcinit();
+
+	/*
+	 *	Initialize fat, in one piece or a sector at a time
+	 */
+	if (fatpages)
+	{
+		fcinit();
+		cp = Malloc(SECSIZE);
+		for (i = 0; i < FATSIZE/SECSIZE; i++)
+		{
+			fatfresh(cp,(long)i*SECSIZE,(long)SECSIZE);
+			for (fatno = 0; fatno < NFAT; fatno++)
+				if (dwrite((long)FAT1 + (long)fatno*FATSIZE
+				    + (long)i*SECSIZE,cp,(long)SECSIZE) != SECSIZE)
+					printf("Write error on FAT copy %d ignored\n",
+						fatno);
+		}
+		free(cp);
+	}
+	else
+	{
+		fat = Malloc(FATSIZE);
+		fatfresh(fat,0L,(long)FATSIZE);
+		fat_mod = 1;
+	}
+
+	/* Entries at the ends of the fill that share a byte */
+	i = NCLUS;
+	NCLUS = FATSIZE*2/3;
+	if (i&1)
+		putfat(i,0xFF9);
+	if (NCLUS&1)
+		putfat(NCLUS-1,0xFF9);
+	NCLUS = i;
+
+	if (zerodata)
+		zero(database,(long)(NCLUS-2)*CLUSIZE);
+}
+
+/*
+ *	Bytes off to off+n of the FAT of an empty disk: the media type
+ *	bytes, every cluster free, and the entries past the last cluster
+ *	reserved (0xFF9), except one that shares a byte with a free one
+ *	at each end of those, which the caller puts in.
+ */
+void
+fatfresh(p,off,n)
+char	*p;
+long	off, n;
+{
+	long	from, to, ph;
+	static	char	pat[] = "\371\237\377\371\237";	/* 0xFF9 0xFF9 */
+
+	memset(p,0,n);
+	for (from = off; from < 3 && from < off+n; from++)
+		p[from-off] = 0xFF;		/* Media type bytes */
+	from = (NCLUS+1)/2*3;			/* First pair past the end */
+	to = (FATSIZE*2/3)/2*3;
+	ph = 0;
+	if (from < off)
+	{
+		ph = (off-from)%3;
+		from = off;
+	}
+	if (to > off+n)
+		to = off+n;
+	if (from < to)
+		fill3(p+from-off,to-from,pat+ph);
+}
+
+/*
+ *	Fill n bytes at p with the three bytes at pat over and over,
+ *	doubling what's done with each copy
+ */
+void
+fill3(p,n,pat)
+register char	*p, *pat;
+register long	n;
+{
+	register long	done;
+
+	for (done = 0; done < 3 && done < n; done++)
+		p[done] = pat[done];
+	for (; done < n; done *= 2)
+		memcpy(p+done,p,n-done < done ? n-done : done);
+}
+
+/*
+ *	Make n bytes of the device from addr on read as zeros, the fast
+ *	way if there is one, else by writing them
+ */
+#define	ZRUN	(64L*1024)	/* Most zeros written at once */
+
+void
+zero(addr,n)
+long	addr, n;
+{
+	char	*buf;
+	long	len;
+#ifndef	NOZERO
+	struct	stat	st;
+	unsigned long long	range[2];
+
+	fstat(disk,&st);
+	if (ovfd >= 0)
+		;			/* The device can't be touched */
+	else if ((st.st_mode&S_IFMT) == S_IFBLK)
+	{
+		range[0] = addr;
+		range[1] = n;
+		if (ioctl(disk,BLKZEROOUT,range) == 0)
+			return;
+	}
+	else if ((st.st_mode&S_IFMT) == S_IFREG)
+	{
+		if (st.st_size <= addr)
+			return;		/* Nothing there to clear */
+		if (st.st_size < addr+n)
+			n = st.st_size-addr;	/* Past the end reads as zeros */
+		if (fallocate(disk,FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+		    addr,n) == 0)
+			return;
+	}
+#endif
+	buf = Malloc(ZRUN);
+	memset(buf,0,ZRUN);
+	for (; n > 0; addr += len, n -= len)
+	{
+		len = n < ZRUN ? n : ZRUN;
+		if (dwrite(addr,buf,len) != len)
+		{
+			printf("Write error clearing the data area\n");
+			break;
+		}
+	}
+	free(buf);
+}
+
+struct	boot
+{
+	uchar	jump[3];	/* 0x EB 1C 90	jump to boot code. */
+	uchar	oem[8];		/* machine name, e.g. "HP150   " */
+	uchar	bps[2];		/* Bytes per sector */
+	uchar	spc;		/* sectors per cluster */
+	uchar	rs[2];		/* reserved sectors */
+	uchar	cf;		/* copies of FAT */
+	uchar	mde[2];		/* maximum dir entries */
+	uchar	ts[2];		/* total sectors */
+	uchar	md;		/* media descriptor */
+	uchar	sf[2];		/* sectors in FAT */
+	uchar	st[2];		/* sectors per track */
+	uchar	nh[2];		/* number of heads */
+	uchar	hs[2];		/* hidden sectors */
+}
+	boot =
+{
+	"\353\34\220",
+	"HP150   ",
+	0			/* Other crud */
+};
+
+/*
+ *	Read the boot record, and take the disk geometry from it.
+ */
+void
+readboot()
+{
+	if (dread(0L, &boot, sizeof(boot)) != sizeof(boot))
+		return;
+
+	if (verbose > 1)
+		showboot(&boot);
+	bpbgeom(&boot);
+}
+
+/*
+ *	If the BIOS parameter block describes a sane FAT12 layout, use it.
+ *	A builtin type that agrees is used by name, otherwise the geometry
+ *	goes into the user defined ('p') slot.  A type named on the command
+ *	line wins, but we complain if the disk says otherwise.
+ *	HP150 disks leave the BPB empty, and get the table type as before.
+ */
+void
+bpbgeom(b)
+register struct	boot	*b;
+{
+	struct	disk	d;
+	register struct	disk	*tp;
+	long	data;
+	int	bps = two(b->bps);
+
+	if (bps < 128 || bps > 4096 || (bps & (bps-1)) != 0
+	 || b->spc == 0 || (b->spc & (b->spc-1)) != 0
+	 || two(b->rs) == 0 || b->cf == 0 || b->cf > 4
+	 || two(b->mde) == 0 || two(b->sf) == 0 || two(b->ts) == 0)
+		return;
+
+	d.secsize = bps;
+	d.clusize = b->spc;
+	d.fat1 = two(b->rs);
+	d.rootdirs = (two(b->mde)*sizeof(dir) + bps-1) / bps;
+	d.fatsize = two(b->sf);
+	d.nfat = b->cf;
+	data = two(b->ts) - d.fat1 - (long)d.nfat*d.fatsize - d.rootdirs;
+	if (data < d.clusize)
+		return;
+	d.nclus = data/d.clusize + 2;
+	if (d.nclus > 0xFF7 || d.nclus > (long)d.fatsize*bps*2/3)
+		return;			/* Not FAT12, or FAT too small */
+
+	for (tp = dtypes; tp->type != '\0'; tp++)
+		if (tp->secsize == d.secsize
+		 && tp->clusize == d.clusize
+		 && tp->fat1 == d.fat1
+		 && tp->rootdirs == d.rootdirs
+		 && tp->fatsize == d.fatsize
+		 && tp->nfat == d.nfat
+		 && tp->nclus == d.nclus)
+			break;
+
+	if (dgiven)
+	{
+		if (tp != &dtypes[dtype])
+			printf("Warning: boot record does not match disk type %c\n",
+				dtypes[dtype].type);
+		return;
+	}
+	if (tp->type == '\0')
+	{
+		for (tp = dtypes; tp->type != 'p'; tp++)
+			;
+		d.type = tp->type;
+		d.tname = tp->tname;
+		*tp = d;
+	}
+	dtype = tp - dtypes;
+	if (verbose > 1)
+		printf("%s\n",tp->tname);
+}
+
+void
+showboot(b)
+struct	boot	*b;
+{
+			/* EB 1C 90 jump to boot code. */
+	printf("jump	%02X %02X %02X\n", b->jump[0], b->jump[1], b->jump[2]);
+	printf("oem	'%.8s' - machine name\n", b->oem);
+	printf("bps	%d - bytes per sector\n", two(b->bps));	
+	printf("spc	%d - sectors per cluster\n", b->spc);		
+	printf("rs	%d - reserved sectors\n", two(b->rs));	
+	printf("cf	%d - copies of FAT\n", b->cf);		
+	printf("mde	%d - maximum dir entries\n", two(b->mde));	
+	printf("ts	%d - total sectors\n", two(b->ts));	
+	printf("md	%d - media descriptor\n", b->md);		
+	printf("sf	%d - sectors in FAT\n", two(b->sf));	
+	printf("st	%d - sectors per track\n", two(b->st));	
+	printf("nh	%d - number of heads\n", two(b->nh));	
+	printf("hs	%d - hidden sectors\n", two(b->hs));	
+}
+
+/*
+ *	Write the boot record.
+ */
+void
+writeboot()
+{
+	/*
+	 *	Fill in boot record, so the geometry can be read back.
+	 */
+	settwo(boot.bps, SECSIZE);
+	boot.spc = dtypes[dtype].clusize;
+	settwo(boot.rs, dtypes[dtype].fat1);
+	boot.cf = NFAT;
+	settwo(boot.mde, NDIR);
+	settwo(boot.ts, dtypes[dtype].fat1 + NFAT*dtypes[dtype].fatsize
+		+ dtypes[dtype].rootdirs + (NCLUS-2)*dtypes[dtype].clusize);
+	boot.md = 0xFF;
+	settwo(boot.sf, dtypes[dtype].fatsize);
+	dwrite(0L, &boot, sizeof(boot));
+
+	/*
+	 *	Write 0xFF at start of second sector. ... Why?
+	 */
+	dwrite((long)SECSIZE,"\377",1);
+}
+
+/*
+ *	Rewrite the fat and/or the root directory after modifying the disk
+ */
+void
+dos_end()
+{
+	int	fatno;
+
+	if (bc)
+	{
+		bcflush(0);
+		if (verbose > 1)
+			fprintf(stderr,
+			    "Cache: %ld hits, %ld misses, %ld clusters written in %ld runs\n",
+			    bc->hits, bc->misses, bc->written, bc->runs);
+	}
+	if (root_mod)
+	{
+		if (dwrite(rootaddr,rootdir,sizeof(dir)*NDIR) != sizeof(dir)*NDIR)
+		    erexit("Write error on root directory - scrambled eggs\n", 0);
+	}
+	if (fat_mod && fc)
+	{		/* Write the pages that changed */
+		for (fatno = 0; fatno < fc->npages; fatno++)
+			if (fc->pages[fatno].dirty)
+				fatwrite(&fc->pages[fatno]);
+	}
+	else if (fat_mod)
+	{		/* Write the fat the required no of times */
+		for (fatno = 0; fatno < NFAT; fatno++)
+		{
+			if (dwrite((long)FAT1 + fatno*FATSIZE,fat,FATSIZE) != FATSIZE)
+				printf("Write error on FAT copy %d ignored\n",fatno);
+		}
+	}
+	if (ovmod)
+		ovflush();
+}
+
+/*
+ *	Deltas between two images of the same geometry.
+ *	A delta is a header (magic number, then hashes of the image before
+ *	and after: the boot area, FATs and root directory, then each cluster
+ *	the image's own FAT has in use), followed by records of
+ *	an address and a length (four bytes each, little-endian) and that
+ *	many bytes to put at that address, in address order. A record of
+ *	length 0 ends it. Only the clusters the new FAT has in use are
+ *	compared, and changed ones next to each other go in one record.
+ */
+#define	DMAGIC	"MARDLT2\n"
+#define	DHEAD	16
+#define	DRUN	16		/* Most clusters in a record */
+#define	FNVINIT	2166136261L
+
+FILE	*dfp;			/* Delta being written */
+
+/*
+ *	FNV-1a hash
+ */
+unsigned long
+fnv(p,n,h)
+register uchar	*p;
+register long	n;
+register unsigned long	h;
+{
+	while (n-- > 0)
+		h = ((h ^ *p++) * 16777619L) & 0xFFFFFFFFL;
+	return h;
+}
+
+/*
+ *	Hash the image on fd (or the device if fd < 0): the boot area, FATs
+ *	and root directory, then the clusters its own FAT has in use.
+ */
+unsigned long
+imghash(fd)
+{
+	char	*sys, *buf, *sfat;
+	struct	fatcache	*sfc;
+	unsigned long	h;
+	int	c, n;
+
+	sys = Malloc(database);
+	zread(fd,0L,sys,database);
+	h = fnv(sys,database,FNVINIT);
+	sfat = fat;
+	sfc = fc;
+	fat = sys+FAT1;
+	fc = NULL;
+	buf = Malloc(DRUN*CLUSIZE);
+	for (c = 2; c < NCLUS; c += n)
+	{
+		for (n = 0; n < DRUN && c+n < NCLUS
+			&& getfat(c+n) != 0 && getfat(c+n) != 0xFF7; n++)
+			;
+		if (n == 0)
+		{
+			n = 1;		/* Free or bad */
+			continue;
+		}
+		zread(fd,(long)(c-2)*CLUSIZE + database,buf,(long)n*CLUSIZE);
+		h = fnv(buf,(long)n*CLUSIZE,h);
+	}
+	fat = sfat;
+	fc = sfc;
+	free(sys);
+	free(buf);
+	return h;
+}
+
+/*
+ *	Read from fd (or the device if fd < 0), as zeros past the end.
+ *	Returns how much was really there.
+ */
+long
+zread(fd,addr,buf,n)
+long	addr;
+char	*buf;
+long	n;
+{
+	long	got;
+
+	if (fd < 0)
+		got = dread(addr,buf,n);
+	else
+	{
+		lseek(fd,addr,0);
+		got = read(fd,buf,n);
+	}
+	if (got < 0)
+		got = 0;
+	memset(buf+got,0,n-got);
+	return got;
+}
+
+/*
+ *	Write a delta record
+ */
+void
+drec(addr,p,n)
+long	addr;
+char	*p;
+long	n;
+{
+	uchar	rec[8];
+
+	setfour(rec,addr);
+	setfour(rec+4,n);
+	fwrite(rec,1,8,dfp);
+	fwrite(p,1,n,dfp);
+}
+
+/*
+ *	Write the delta from the device to newname on the file out (or '-')
+ */
+void
+mkdelta(newname,out)
+char	*newname, *out;
+{
+	struct	boot	nb;
+	uchar	head[DHEAD];
+	char	*old, *new, *run, *oclus, *sfat;
+	struct	fatcache	*sfc;
+	long	a, r, n;
+	int	nfd, c, rc, nrun, nchanged = 0;
+
+	if ((nfd = open(newname,0)) < 0)
+	{
+		perror(newname);
+		exit(1);
+	}
+	if (strcmp(out,"-") == 0)
+		dfp = stdout;
+	else if ((dfp = fopen(out,"w")) == NULL)
+	{
+		perror(out);
+		exit(1);
+	}
+	if (read(nfd,&nb,sizeof(nb)) != sizeof(nb)
+	 || memcmp(nb.bps,boot.bps,nb.st-nb.bps) != 0)
+		erexit("%s: geometry is not the same\n", newname);
+
+	old = Malloc(database);
+	new = Malloc(database);
+	zread(-1,0L,old,database);
+	zread(nfd,0L,new,database);
+	strncpy((char *)head,DMAGIC,8);
+	setfour(head+8,imghash(-1));
+	setfour(head+12,imghash(nfd));
+	fwrite(head,1,DHEAD,dfp);
+
+	/*
+	 *	Changed runs of sectors in the boot area, FATs and root
+	 */
+	for (a = 0; a < database; a = r)
+	{
+		for (r = a;
+		     r < database && memcmp(old+r,new+r,SECSIZE) != 0;
+		     r += SECSIZE)
+			;
+		if (r == a)
+			r += SECSIZE;
+		else
+			drec(a,new+a,r-a);
+	}
+
+	/*
+	 *	Changed clusters that are in use in the new image
+	 */
+	sfat = fat;		/* Use the new FAT from here on */
+	sfc = fc;
+	fat = new+FAT1;
+	fc = NULL;
+	run = Malloc(DRUN*CLUSIZE);
+	oclus = Malloc(CLUSIZE);
+	for (c = 2, rc = nrun = 0; c <= NCLUS; c++)
+	{
+		if (c < NCLUS && getfat(c) != 0 && getfat(c) != 0xFF7)
+		{
+			a = (long)(c-2)*CLUSIZE + database;
+			n = zread(-1,a,oclus,(long)CLUSIZE);
+			zread(nfd,a,run+(long)nrun*CLUSIZE,(long)CLUSIZE);
+			if (n < CLUSIZE		/* Old image is short */
+			 || memcmp(oclus,run+(long)nrun*CLUSIZE,CLUSIZE) != 0)
+			{
+				if (nrun == 0)
+					rc = c;
+				nchanged++;
+				if (++nrun < DRUN)
+					continue;
+			}
+		}
+		if (nrun)
+			drec((long)(rc-2)*CLUSIZE + database,run,(long)nrun*CLUSIZE);
+		nrun = 0;
+	}
+	drec(0L,"",0L);
+	if (fflush(dfp) == EOF || (dfp != stdout && fclose(dfp) == EOF))
+		erexit("%s: write error\n", out);
+	if (verbose && dfp != stdout)
+		printf("%d clusters changed\n",nchanged);
+	fat = sfat;
+	fc = sfc;
+	free(old);
+	free(new);
+	free(run);
+	free(oclus);
+	close(nfd);
+}
+
+/*
+ *	Apply a delta to the device in one pass
+ */
+void
+apdelta(name)
+char	*name;
+{
+	FILE	*fp;
+	uchar	head[DHEAD], rec[8];
+	char	*buf;
+	long	n, bufsize;
+
+	if (strcmp(name,"-") == 0)
+		fp = stdin;
+	else if ((fp = fopen(name,"r")) == NULL)
+	{
+		perror(name);
+		exit(1);
+	}
+	if (fread(head,1,DHEAD,fp) != DHEAD
+	 || strncmp((char *)head,DMAGIC,8) != 0)
+		erexit("%s: not a mar delta\n", name);
+
+	bcflush(1);		/* Records go straight to the device */
+	bufsize = database > DRUN*CLUSIZE ? database : DRUN*CLUSIZE;
+	buf = Malloc(bufsize);
+	if (imghash(-1) != four(head+8))
+		erexit("%s: delta is not for this image\n", name);
+
+	while (fread(rec,1,8,fp) == 8 && (n = four(rec+4)) != 0)
+	{
+		if (n > bufsize)
+		{
+			free(buf);
+			buf = Malloc(bufsize = n);
+		}
+		if (fread(buf,1,n,fp) != n)
+			erexit("%s: delta is short - image is part done\n", name);
+		if (dwrite(four(rec),buf,n) != n)
+			erexit("Write error applying delta - image is part done\n", 0);
+	}
+	if (fp != stdin)
+		fclose(fp);
+
+	if (imghash(-1) != four(head+12))
+	{
+		printf("Image doesn't match the delta's after applying it\n");
+		nerrors++;
+	}
+	free(buf);
+}
+
+/*
+ *	Copying from one image to another.
+ *	Everything that belongs to an open device is kept in a vol while
+ *	the other one is being used.
+ */
+struct	vol
+{
+	int	disk;
+	int	dtype;
+	struct	disk	geom;
+	dir	*rootdir;
+	char	*fat;
+	struct	fatcache	*fc;
+	struct	bcache	*bc;
+	int	root_mod, fat_mod;
+	long	rootaddr, database;
+}	vsrc, vdst;
+
+#define	CRUN	16		/* Most clusters moved at once */
+
+/*
+ *	Put the open device away in v
+ */
+void
+vput(v)
+register struct	vol	*v;
+{
+	v->disk = disk;
+	v->dtype = dtype;
+	v->geom = dtypes[dtype];
+	v->rootdir = rootdir;
+	v->fat = fat;
+	v->fc = fc;
+	v->bc = bc;
+	v->root_mod = root_mod;
+	v->fat_mod = fat_mod;
+	v->rootaddr = rootaddr;
+	v->database = database;
+}
+
+/*
+ *	Make v the open device
+ */
+void
+vget(v)
+register struct	vol	*v;
+{
+	disk = v->disk;
+	dtype = v->dtype;
+	dtypes[dtype] = v->geom;
+	rootdir = v->rootdir;
+	fat = v->fat;
+	fc = v->fc;
+	bc = v->bc;
+	root_mod = v->root_mod;
+	fat_mod = v->fat_mod;
+	rootaddr = v->rootaddr;
+	database = v->database;
+}
+
+/*
+ *	Copy the named files and directories (or everything) from the
+ *	device to the image named first, keeping their attributes and
+ *	times. Cluster data goes straight from one to the other.
+ */
+void
+imcopy()
+{
+	dir	*dirp, *dp, ent;
+	int	num, start;
+
+	vput(&vsrc);
+	device = *files++;
+	nfiles--;
+	cmd = 'r';		/* Open it for writing */
+	opendevice();
+	cmd = 'C';
+	vput(&vdst);
+	vget(&vsrc);
+
+	if (nfiles == 0)
+	{
+		for (dp = rootdir; dp < rootdir+NDIR && dp->name[0] != 0; dp++)
+			if (dp->name[0] != (char)0xE5 && (dp->attr&VOLUME) == 0)
+			{
+				pinit(fixname(dp->name));
+				cptree(dp);
+			}
+	}
+	else for (; nfiles--; files++)
+	{
+		if ((dp = lookup(*files,&dirp,&num,&start)) == NULL)
+		{
+			printf("%s: not found\n",*files);
+			nerrors++;
+			continue;
+		}
+		ent = *dp;
+		if (dirp != rootdir)
+			free(dirp);
+		pinit(*files);
+		cptree(&ent);
+	}
+	vput(&vsrc);
+	vget(&vdst);		/* dos_end() is for the destination */
+}
+
+/*
+ *	Copy an entry (and all in it) to pathbuf on the destination.
+ *	Called and returns with the source open.
+ */
+void
+cptree(sp)
+dir	*sp;
+{
+	dir	ent, *sub, *dp;
+	int	clus, num, len;
+
+	ent = *sp;
+	if ((ent.attr&DIRECT) == 0)
+	{
+		clus = cpdata(&ent);
+		vput(&vsrc);
+		vget(&vdst);
+		if (clus >= 0)
+		{
+			if (cpput(pathbuf,&ent,clus) >= 0)
+				show('C',pathbuf);
+			else
+				truncate(clus);	/* Give back the copy */
+		}
+		vput(&vdst);
+		vget(&vsrc);
+		return;
+	}
+
+	vput(&vsrc);
+	vget(&vdst);
+	clus = cpput(pathbuf,&ent,0);
+	vput(&vdst);
+	vget(&vsrc);
+	if (clus < 0)
+		return;
+	show('C',pathbuf);
+
+	sub = getdir(dstart(&ent));
+	num = getdir_num;
+	for (dp = sub; dp < sub+num && dp->name[0] != 0; dp++)
+	{
+		if (dp->name[0] == (char)0xE5 || dp->name[0] == '.'
+		 || dp->attr&VOLUME)
+			continue;
+		len = ppush(fixname(dp->name));
+		cptree(dp);
+		ppop(len);
+	}
+	free(sub);
+}
+
+/*
+ *	Copy a file's clusters, a run at a time, to newly allocated
+ *	clusters on the destination. Returns the first of them
+ *	(0 for an empty file) or -1 if there was no room.
+ *	Called and returns with the source open.
+ */
+cpdata(ep)
+dir	*ep;
+{
+	char	*buf;
+	int	clus, next, n, m, i, j, left;
+	int	first = 0, last = 0, hint = 2;
+
+	left = (dsize(ep)+CLUSIZE-1)/CLUSIZE;
+	if (left == 0)
+		return 0;
+	vput(&vsrc);
+	vget(&vdst);
+	if (diskfree() < (long)left*CLUSIZE)
+	{
+		printf("No room to add file %s\n",pathbuf);
+		nerrors++;
+		vput(&vdst);
+		vget(&vsrc);
+		return -1;
+	}
+	vput(&vdst);
+	vget(&vsrc);
+
+	buf = Malloc(CRUN*CLUSIZE);
+	for (clus = dstart(ep); left > 0 && clus >= 2 && clus < NCLUS;
+	     clus = next)
+	{
+		for (n = 1; n < CRUN && n < left && getfat(clus+n-1) == clus+n;
+		     n++)
+			;
+		zread(-1,(long)(clus-2)*CLUSIZE + database,buf,(long)n*CLUSIZE);
+		next = getfat(clus+n-1);
+		left -= n;
+
+		/*
+		 *	Write it in as few extents as will hold it
+		 */
+		vput(&vsrc);
+		vget(&vdst);
+		for (i = 0; i < n; i += m)
+		{
+			while (getfat(hint) != 0)
+				hint++;
+			for (m = 1; i+m < n && hint+m < NCLUS
+				&& getfat(hint+m) == 0; m++)
+				;
+			bcforget(hint,m);
+			if (dwrite((long)(hint-2)*CLUSIZE + database,
+			    buf+(long)i*CLUSIZE,(long)m*CLUSIZE) != m*CLUSIZE)
+				erexit("Write error copying %s\n", pathbuf);
+			if (last)
+				putfat(last,hint);
+			else
+				first = hint;
+			for (j = hint; j < hint+m-1; j++)
+				putfat(j,j+1);
+			putfat(hint+m-1,0xFF8);
+			last = hint+m-1;
+			hint += m;
+		}
+		vput(&vdst);
+		vget(&vsrc);
+	}
+	free(buf);
+	return first;
+}
+
+/*
+ *	Make the entry for path on the destination, a copy of *ep starting
+ *	at clus, and any directories in the path that aren't there.
+ *	A directory that is already there is kept, and a file replaced.
+ *	On failure the caller still owns the clusters from clus.
+ *	Returns the entry's first cluster, or -1 if it can't be made.
+ */
+cpput(path,ep,clus)
+char	*path;
+dir	*ep;
+{
+	dir	*dirp = rootdir, *dp;
+	int	num = NDIR, start = 0, new;
+	char	*namepart, *end;
+	char	want[11];
+
+	for (namepart = path; ; namepart = end+1)
+	{
+		end = strchr(namepart,'/');
+		if (end != NULL)
+			*end = '\0';
+		dosname(want,namepart);
+		if (end != NULL)
+			*end = '/';
+		for (dp = dirp; dp < dirp+num && dp->name[0] != 0; dp++)
+			if (strncmp(want,dp->name,11) == 0)
+				break;
+
+		if (dp < dirp+num && dp->name[0] != 0)
+		{		/* It's there */
+			if ((dp->attr&DIRECT) == 0)
+			{
+				if (end != NULL || ep->attr&DIRECT)
+				{
+					printf("%s is not a directory\n",path);
+					goto bad;
+				}
+				truncate(dstart(dp));
+				break;		/* Use the same entry */
+			}
+			if (end == NULL && (ep->attr&DIRECT) == 0)
+			{
+				printf("%s is a directory\n",path);
+				goto bad;
+			}
+			start = dstart(dp);
+			if (dirp != rootdir)
+				free(dirp);
+			if (end == NULL)
+				return start;	/* Keep the directory */
+			dirp = getdir(start);
+			num = getdir_num;
+			continue;
+		}
 
-	if (i < 2 || i >= NCLUS)
-		return;
-	num = i*3/2;
-	if (i&01)
-	{
-		fat[num] = (fat[num]&0xF) | ((val<<4)&0xF0);
-		fat[num+1] = (val>>4)&0xFF;
+		/*
+		 *	Find a slot, or grow the directory by one
+		 */
+		for (dp = dirp; dp < dirp+num; dp++)
+			if (dp->name[0] == (char)0xE5 || dp->name[0] == 0)
+				break;
+		if (dp == dirp+num)
+		{
+			if (dirp == rootdir)
+			{
+				printf("%s: No more room in root directory\n",
+					path);
+				goto bad;
+			}
+			num++;
+		}
+		if (end == NULL)
+			break;
+
+		/* Make a directory that's in the path */
+		*dp = *ep;
+		strncpy(dp->name,want,11);
+		dp->attr = DIRECT|ARCHIVE;
+		setsize(dp,0);
+		if ((new = newdclus(start)) == 0)
+			goto room;
+		setstart(dp,new);
+		putdir(start,dirp,num);
+		if (dirp != rootdir)
+			free(dirp);
+		dirp = getdir(start = new);
+		num = getdir_num;
 	}
-	else
+
+	*dp = *ep;
+	strncpy(dp->name,want,11);
+	if (ep->attr&DIRECT && (clus = newdclus(start)) == 0)
 	{
-		fat[num] = val&0xFF;
-		fat[num+1] = (fat[num+1]&0xF0) | ((val>>8)&0xF);
+	room:	printf("No room to add %s\n",path);
+		dp->name[0] = 0xE5;
+		goto bad;
 	}
-	fat_mod = 1;
+	setstart(dp,clus);
+	putdir(start,dirp,num);
+	if (dirp != rootdir)
+		free(dirp);
+	return clus;
+
+ bad:
+	if (dirp != rootdir)
+		free(dirp);
+	nerrors++;
+	return -1;
 }
 
 /*
- *	Find a free cluster
+ *	Make a new empty directory whose parent starts at parent.
+ *	Returns its cluster, or 0 if there's no room.
  */
-getfree()
+newdclus(parent)
 {
-	int	i;
+	dir	*nd;
+	int	new;
 
-	for (i = 2; i < NCLUS; i++)
-		if (getfat(i) == 0)
-			return i;
-	return 0;	/* None free */
+	if ((new = getfree()) == 0)
+		return 0;
+	nd = (dir *)Malloc(CLUSIZE);
+	memset(nd,0,CLUSIZE);
+	makedir(nd,".");
+	setstart(nd,new);
+	makedir(nd+1,"..");
+	setstart(nd+1,parent);
+	putfat(new,0xFF8);
+	writeclus(new,(char *)nd);
+	free(nd);
+	return new;
 }
 
 /*
- *	Return free space on disk in bytes
+ *	Turn an MSDOS format name into a UNIX format name
  */
-long
-diskfree()
+char * 
+fixname(dosname)
+char	*dosname;
 {
-	long	space = 0;
-	int	i;
+	register	k;
+	static	char	buf[14];
+	register char	*cp = buf;
 
-	for (i = 2; i < NCLUS; i++)
-		if (getfat(i) == 0)
-			space++;
-	return space*CLUSIZE;
+	for (k = 0; k < 8 && dosname[k] != ' '; k++)
+		*cp++ = lcase(dosname[k]);
+	*cp = '\0';
+	if (dosname[8] == ' ')
+		return buf;
+	*cp++ = '.';
+	for (k = 8; k < 11 && dosname[k] != ' '; k++)
+		*cp++ = lcase(dosname[k]);
+	*cp = '\0';
+	return buf;
 }
 
 /*
- *	Read in the file allocation table (fat)
- *	and the root directory
+ *	Add a component to the path.
+ *	Return the length before, to give back to ppop().
  */
-dir *
-getdisk()
+ppush(name)
+char	*name;
 {
-	long	fatno;
-
-	/*
-	 *	Read the boot record.
-	 */
-	readboot();
-
-	rootdir = (dir *)Malloc(sizeof(dir)*NDIR);
-	fat = Malloc(FATSIZE);
-
-	/* Get fat */
-	for (
-	    fatno = 0;
-	    fatno < NFAT
-	 && lseek(disk,FAT1 + fatno*FATSIZE,0) != -1
-	 && read(disk,fat,FATSIZE) != FATSIZE;	/* Try again if read error */
-	    fatno++
-	)
-		;
+	int	old = pathlen;
+	int	n = strlen(name);
 
-	if (cmd != 't' && fatno == NFAT)
-		erexit("Can't read file allocation table\n", 0);
-
-	/* seek to start of directory */
-	lseek(disk,rootaddr = FAT1 + NFAT*FATSIZE,0);
-	if (read(disk,rootdir,sizeof(dir)*NDIR) != sizeof(dir)*NDIR)
-		erexit("Read error on root directory\n", 0);
-	database = lseek(disk,0L,1);
-	return fixdir(rootdir,NDIR);
+	if (pathlen+n+2 > pathmax)
+	{
+		pathmax = (pathlen+n+2)*2;
+		pathbuf = pathbuf ? realloc(pathbuf,pathmax) : Malloc(pathmax);
+		if (pathbuf == NULL)
+			erexit("Help! Out of memory... aborting\n", 0);
+	}
+	if (pathlen != 0)
+		pathbuf[pathlen++] = '/';
+	memcpy(pathbuf+pathlen,name,n+1);
+	pathlen += n;
+	return old;
 }
 
 /*
- *	Initialize the fat, and the root directory
+ *	Take the path back to what it was before a ppush()
  */
 void
-dos_format()
+ppop(old)
 {
-	register char	*cp;
-	register nclus, i;
-	int	rds;
-	dir	*dp;
-
-	/*
-	 *	Write the boot record.
-	 */
-	writeboot();
-
-	/*
-	 *	Create empty root directory
-	 */
-	rds = sizeof(dir)*NDIR;
-	rootaddr = FAT1+NFAT*FATSIZE;
-	database = rootaddr+rds;
-	rootdir = (dir *)Malloc(rds);
-	cp = (char *)rootdir;
-	while (cp < (char *)rootdir+rds)
-		*cp++ = 0xE5;
-
-	for (dp = rootdir; dp < rootdir+NDIR; dp++)
-		dp->name[0] = 0;
-	root_mod = 1;
-
-	/*
-	 *	Initialize fat
-	 */
-	fat = Malloc(FATSIZE);
-	fat[0] = fat[1] = fat[2] = 0xFF;	/* Media type bytes */
-
-	nclus = NCLUS;
-	NCLUS = FATSIZE*2/3;
-	for (i = nclus; i < NCLUS; i++)
-		putfat(i,0xFF9);		/* Fill end of fat */
-	NCLUS = nclus;
-
-	for (i = 2; i < NCLUS; i++)
-		putfat(i,0);			/* Mark it free */
+	pathlen = old;
+	if (pathbuf)
+		pathbuf[old] = '\0';
 }
 
-typedef	unsigned char	uchar;
-
-struct	boot
+/*
+ *	Start the path off as name
+ */
+void
+pinit(name)
+char	*name;
 {
-	uchar	jump[3];	/* 0x EB 1C 90	jump to boot code. */
-	uchar	oem[8];		/* machine name, e.g. "HP150   " */
-	uchar	bps[2];		/* Bytes per sector */
-	uchar	spc;		/* sectors per cluster */
-	uchar	rs[2];		/* reserved sectors */
-	uchar	cf;		/* copies of FAT */
-	uchar	mde[2];		/* maximum dir entries */
-	uchar	ts[2];		/* total sectors */
-	uchar	md;		/* media descriptor */
-	uchar	sf[2];		/* sectors in FAT */
-	uchar	st[2];		/* sectors per track */
-	uchar	nh[2];		/* number of heads */
-	uchar	hs[2];		/* hidden sectors */
+	ppop(0);
+	ppush(name);
 }
-	boot =
-{
-	"\353\34\220",
-	"HP150   ",
-	0			/* Other crud */
-};
 
 /*
- *	Read the boot record.
+ *	Copy-on-write overlay.
+ *	With 'O', the device is only read, and everything written goes to
+ *	the overlay file instead, at OVDATA plus its address on the device.
+ *	A bit per OVBLK bytes of the device says which blocks are there.
+ *	The overlay starts with a block holding the magic number and the
+ *	number of blocks mapped, then the map; being sparse, it takes only
+ *	as much space as was written.
+ */
+#define	OVBLK	512
+#define	OVMIN	(32L*1024*1024)		/* Map at least this much */
+#define	OVMAGIC	"MAROVL1\n"
+#define	OVDATA	(OVBLK + (ovnblk/8+OVBLK-1)/OVBLK*OVBLK)
+#define	OVHAS(b)	((b) < ovnblk && (ovmap[(b)>>3] & 1<<((b)&7)))
+#define	OVSET(b)	(ovmap[(b)>>3] |= 1<<((b)&7))
+
+/*
+ *	Open the overlay, making it if it isn't there
  */
 void
-readboot()
+ovopen()
 {
-	lseek(disk,0L,0);
-	read(disk, &boot, sizeof(boot));
+	uchar	head[OVBLK];
+	long	size;
 
-	showboot(&boot);
+	if ((ovfd = open(ovname,2)) >= 0)
+	{
+		if (read(ovfd,head,OVBLK) != OVBLK
+		 || strncmp((char *)head,OVMAGIC,8) != 0)
+			erexit("%s: not a mar overlay\n", ovname);
+		ovnblk = four(head+8);
+		ovmap = (uchar *)Malloc(ovnblk/8+1);
+		if (read(ovfd,ovmap,ovnblk/8+1) != ovnblk/8+1)
+			erexit("%s: overlay map is short\n", ovname);
+		return;
+	}
+	if (errno != ENOENT || (ovfd = open(ovname,O_RDWR|O_CREAT,0666)) < 0)
+	{
+		perror(ovname);
+		exit(1);
+	}
+	size = lseek(disk,0L,2);	/* st_size is 0 for a block device */
+	ovnblk = (size > OVMIN ? size : OVMIN) / OVBLK + 1;
+	ovmap = (uchar *)Malloc(ovnblk/8+1);
+	memset(ovmap,0,ovnblk/8+1);
+	memset(head,0,OVBLK);
+	strncpy((char *)head,OVMAGIC,8);
+	setfour(head+8,ovnblk);
+	if (write(ovfd,head,OVBLK) != OVBLK || ftruncate(ovfd,OVDATA) < 0)
+		erexit("%s: can't write overlay\n", ovname);
 }
 
-#define	two(p)	((p[1]<<8) + p[0])
-
+/*
+ *	Write back the overlay map
+ */
 void
-showboot(b)
-struct	boot	*b;
+ovflush()
 {
-			/* EB 1C 90 jump to boot code. */
-	printf("jump	%02X %02X %02X\n", b->jump[0], b->jump[1], b->jump[2]);
-	printf("oem	'%.8s' - machine name\n", b->oem);
-	printf("bps	%d - bytes per sector\n", two(b->bps));	
-	printf("spc	%d - sectors per cluster\n", b->spc);		
-	printf("rs	%d - reserved sectors\n", two(b->rs));	
-	printf("cf	%d - copies of FAT\n", b->cf);		
-	printf("mde	%d - maximum dir entries\n", two(b->mde));	
-	printf("ts	%d - total sectors\n", two(b->ts));	
-	printf("md	%d - media descriptor\n", b->md);		
-	printf("sf	%d - sectors in FAT\n", two(b->sf));	
-	printf("st	%d - sectors per track\n", two(b->st));	
-	printf("nh	%d - number of heads\n", two(b->nh));	
-	printf("hs	%d - hidden sectors\n", two(b->hs));	
+	lseek(ovfd,(long)OVBLK,0);
+	if (write(ovfd,ovmap,ovnblk/8+1) != ovnblk/8+1)
+		printf("Write error on overlay map - scrambled eggs\n");
+	ovmod = 0;
 }
 
 /*
- *	Write the boot record.
+ *	Make sure a block is in the overlay before part of it is written
  */
 void
-writeboot()
+ovfill(b)
+long	b;
 {
-	lseek(disk,0L,0);
-
-	/*
-	 *	Fill in boot record.
-	 */
-	write(disk, &boot, sizeof(boot));
+	char	blk[OVBLK];
+	int	n;
 
-	/*
-	 *	Write 0xFF at start of second sector. ... Why?
-	 */
-	lseek(disk,(long)SECSIZE,0);
-	write(disk,"\377",1);
+	if (OVHAS(b))
+		return;
+	lseek(disk,b*OVBLK,0);
+	if ((n = read(disk,blk,OVBLK)) < 0)
+		n = 0;
+	memset(blk+n,0,OVBLK-n);	/* Device may be short */
+	lseek(ovfd,OVDATA + b*OVBLK,0);
+	write(ovfd,blk,OVBLK);
+	OVSET(b);
 }
 
 /*
- *	Rewrite the fat and/or the root directory after modifying the disk
+ *	Read from the device, or the overlay where it has the blocks.
+ *	Runs of blocks from the same place are read at once.
  */
-void
-dos_end()
+dread(addr,buf,n)
+long	addr;
+char	*buf;
+long	n;
 {
-	int	fatno;
+	long	b, len, total = 0;
+	int	in, got;
 
-	if (root_mod)
+	if (ovfd < 0)
+		return pread(disk,buf,(size_t)n,(off_t)addr);
+	while (n > 0)
 	{
-		fixdir(rootdir,NDIR);
-		lseek(disk,rootaddr,0);
-		if (write(disk,rootdir,sizeof(dir)*NDIR) != sizeof(dir)*NDIR)
-		    erexit("Write error on root directory - scrambled eggs\n", 0);
-	}
-	if (fat_mod)
-	{		/* Write the fat the required no of times */
-		for (fatno = 0; fatno < NFAT; fatno++)
+		b = addr/OVBLK;
+		in = OVHAS(b);
+		len = OVBLK - addr%OVBLK;
+		while (len < n && (OVHAS(b+1) != 0) == (in != 0))
 		{
-			lseek(disk,FAT1 + fatno*FATSIZE,0);
-			if (write(disk,fat,FATSIZE) != FATSIZE)
-				printf("Write error on FAT copy %d ignored\n",fatno);
+			b++;
+			len += OVBLK;
+		}
+		if (len > n)
+			len = n;
+		if (in)
+		{
+			lseek(ovfd,OVDATA + addr,0);
+			got = read(ovfd,buf,len);
+		}
+		else
+		{
+			lseek(disk,addr,0);
+			got = read(disk,buf,len);
 		}
+		if (got < 0)
+			return total ? total : got;
+		total += got;
+		if (got < len)
+			break;
+		addr += len;
+		buf += len;
+		n -= len;
 	}
+	return total;
 }
 
 /*
- *	Turn an MSDOS format name into a UNIX format name
+ *	Write to the device, or to the overlay if there is one
  */
-char * 
-fixname(dosname)
-char	*dosname;
+dwrite(addr,buf,n)
+long	addr;
+char	*buf;
+long	n;
 {
-	register	k;
-	static	char	buf[14];
-	register char	*cp = buf;
+	long	b;
+	int	done;
 
-	for (k = 0; k < 8 && dosname[k] != ' '; k++)
-		*cp++ = lcase(dosname[k]);
-	*cp = '\0';
-	if (dosname[8] == ' ')
-		return buf;
-	*cp++ = '.';
-	for (k = 8; k < 11 && dosname[k] != ' '; k++)
-		*cp++ = lcase(dosname[k]);
-	*cp = '\0';
-	return buf;
+	if (ovfd < 0)
+		return pwrite(disk,buf,(size_t)n,(off_t)addr);
+	if ((addr+n+OVBLK-1)/OVBLK > ovnblk)
+	{
+		fprintf(stderr,"%s: overlay map is full\n",ovname);
+		return -1;
+	}
+	if (addr%OVBLK)
+		ovfill(addr/OVBLK);
+	if ((addr+n)%OVBLK)
+		ovfill((addr+n)/OVBLK);
+	lseek(ovfd,OVDATA + addr,0);
+	if ((done = write(ovfd,buf,n)) != n)
+		return done;
+	for (b = addr/OVBLK; b*OVBLK < addr+n; b++)
+		OVSET(b);
+	ovmod = 1;
+	return done;
 }
 
 /*
@@ -1788,11 +5581,18 @@ readclus(clus,data)
 char	*data;
 {
 	register char	*dp;
+	register struct	bcblk	*bp;
 
-	lseek(disk, (clus-2)*CLUSIZE + database,0);
-	if (read(disk,data,CLUSIZE) != CLUSIZE)
+	if (bc && clus >= 2 && clus < NCLUS)
+	{
+		if ((bp = bcget(clus,1)) == NULL)
+			goto bad;
+		memcpy(data,bp->data,CLUSIZE);
+		return 1;
+	}
+	if (dread((long)(clus-2)*CLUSIZE + database,data,CLUSIZE) != CLUSIZE)
 	{
-		fprintf(stderr,"Read error on cluster %d ignored\n",clus);
+	bad:	fprintf(stderr,"Read error on cluster %d ignored\n",clus);
 		for (dp = data; dp < data+CLUSIZE; dp++)
 			*dp = 0;
 		return 0;
@@ -1806,8 +5606,20 @@ char	*data;
 writeclus(clus,data)
 char	*data;
 {
-	lseek(disk, (clus-2)*CLUSIZE + database,0);
-	if (write(disk,data,CLUSIZE) != CLUSIZE)
+	register struct	bcblk	*bp;
+
+	if (bc && clus >= 2 && clus < NCLUS)
+	{
+		bp = bcget(clus,0);
+		memcpy(bp->data,data,CLUSIZE);
+		if (!bp->dirty)
+		{
+			bp->dirty = 1;
+			bc->ndirty++;
+		}
+		return 1;
+	}
+	if (dwrite((long)(clus-2)*CLUSIZE + database,data,CLUSIZE) != CLUSIZE)
 	{
 		fprintf(stderr,"Write error on cluster %d\n",clus);
 		return 0;
@@ -1816,44 +5628,123 @@ char	*data;
 }
 
 /*
- *	Return 2 if any of the files in "files" is a prefix of "name"
- *	return 1 if "name" is a prefix of any of the files in "files"
+ *	Start an empty cluster cache for the device just opened
  */
-ismatch(name)
-char	*name;
+void
+bcinit()
 {
-	int	i;
+	register i;
 
-	if (nfiles == 0)
-		return 2;
-	for (i = 0; i < nfiles; i++)
+	bc = NULL;
+	if (bcblocks == 0)
+		return;
+	bc = (struct bcache *)Malloc(sizeof(struct bcache));
+	bc->nblks = bcblocks < NCLUS ? bcblocks : NCLUS;
+	bc->blks = (struct bcblk *)Malloc(bc->nblks*sizeof(struct bcblk));
+	for (i = 0; i < bc->nblks; i++)
 	{
-		if (strncmp(name,files[i],strlen(files[i])) == 0)
-			return 2;	/* files[i] is a prefix */
-		if (strncmp(name,files[i],strlen(name)) == 0)
-			return 1;	/* name is a prefix */
+		bc->blks[i].clus = -1;
+		bc->blks[i].dirty = 0;
+		bc->blks[i].used = 0;
+		bc->blks[i].data = Malloc(CLUSIZE);
 	}
-	return 0;
+	bc->slot = (int *)Malloc(NCLUS*sizeof(int));
+	for (i = 0; i < NCLUS; i++)
+		bc->slot[i] = -1;
+	bc->run = Malloc(BCRUN*CLUSIZE);
+	bc->ndirty = 0;
+	bc->clock = bc->hits = bc->misses = bc->written = bc->runs = 0;
+}
+
+/*
+ *	The cache block for a cluster, reading the cluster in if need be
+ *	and it's wanted. Returns NULL on a read error.
+ */
+struct bcblk *
+bcget(clus,want)
+{
+	register struct	bcblk	*bp, *lru;
+	register s;
+
+	if ((s = bc->slot[clus]) >= 0)
+		bc->hits++;
+	else
+	{
+		bc->misses++;
+		for (lru = bp = bc->blks; bp < bc->blks+bc->nblks; bp++)
+			if (bp->used < lru->used)
+				lru = bp;
+		if (lru->dirty)
+			bcflush(0);	/* Its neighbours go too */
+		if (lru->clus >= 0)
+			bc->slot[lru->clus] = -1;
+		lru->clus = -1;
+		if (want && dread((long)(clus-2)*CLUSIZE + database,
+				lru->data,(long)CLUSIZE) != CLUSIZE)
+			return NULL;
+		lru->clus = clus;
+		bc->slot[clus] = s = lru - bc->blks;
+	}
+	bp = &bc->blks[s];
+	bp->used = ++bc->clock;
+	return bp;
 }
 
 /*
- *	Byte swapping routine
- *	swap bytes in cp for len
+ *	Write back the changed clusters in the cache, runs of neighbours
+ *	at once. If drop, empty the cache as well.
  */
 void
-myswab(cp,len)
-char	*cp;
+bcflush(drop)
 {
-	char	c;
+	register struct	bcblk	*bp;
+	register c, n;
 
-	while (len >= 2)
+	if (bc == NULL)
+		return;
+	for (c = 2; bc->ndirty > 0 && c < NCLUS; c += n ? n : 1)
 	{
-		c = *cp;
-		*cp = cp[1];
-		cp[1] = c;
-		len -= 2;
-		cp += 2;
+		for (n = 0; n < BCRUN && c+n < NCLUS && bc->slot[c+n] >= 0
+			&& (bp = &bc->blks[bc->slot[c+n]])->dirty; n++)
+		{
+			memcpy(bc->run+(long)n*CLUSIZE,bp->data,CLUSIZE);
+			bp->dirty = 0;
+			bc->ndirty--;
+		}
+		if (n == 0)
+			continue;
+		if (dwrite((long)(c-2)*CLUSIZE + database,bc->run,(long)n*CLUSIZE)
+		  != (long)n*CLUSIZE)
+			fprintf(stderr,"Write error on clusters %d to %d\n",c,c+n-1);
+		bc->written += n;
+		bc->runs++;
 	}
+	if (drop)
+		bcforget(2,NCLUS-2);
+}
+
+/*
+ *	Forget any cached copy of n clusters from clus on,
+ *	which are about to be written some other way
+ */
+void
+bcforget(clus,n)
+{
+	register struct	bcblk	*bp;
+
+	if (bc == NULL)
+		return;
+	for (; n > 0; n--, clus++)
+		if (clus >= 2 && clus < NCLUS && bc->slot[clus] >= 0)
+		{
+			bp = &bc->blks[bc->slot[clus]];
+			if (bp->dirty)
+				bc->ndirty--;
+			bp->dirty = 0;
+			bp->clus = -1;
+			bp->used = 0;
+			bc->slot[clus] = -1;
+		}
 }
 
 /*